@@ -1,41 +1,53 @@
-#if !(defined(__AVR) || defined(AVR) || defined(__AVR_ATmega328P__))
-#define __AVR_ATmega328P__
-#endif
-
-#include <avr/interrupt.h>
-#include <avr/io.h>
-#include <avr/sleep.h>
 #include <inttypes.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
-#include <util/delay.h>
 #include "buffer.h"
+#include "colour.h"
 #include "constants.h"
+#include "hal.h"
+#include "hrclock.h"
 #include "packet.h"
+#include "params.h"
+#include "pid.h"
+#include "pose.h"
+#include "profile.h"
+#include "scheduler.h"
 #include "serialize.h"
+#include "systick.h"
+#include "txqueue.h"
+#include "ultrasonic.h"
+#include "velocity.h"
 
-// use L and H for 16 bit regs
-#define rbi(sfr, bit) (_SFR_BYTE(sfr) & _BV(bit))
-#define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
-#define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
-#define BUF_LEN 512
+// Serial receive ring size. A power of two up to 256 that holds at least
+// the flow control window and a stop token.
+#define RECV_BUF_LEN 256
+static_assert(RECV_WINDOW + STOP_TOKEN_SIZE <= RECV_BUF_LEN - 1,
+              "recvbuf must hold the window and a stop token");
 
 // Number of ticks per revolution from the wheel encoder.
 #define COUNTS_PER_REV 200
 
-// Wheel circumference in cm used to calculate forward/backward distance
-// traveled by taking revs * WHEEL_CIRC.
-#define WHEEL_CIRC 20.42
-
 // Motor control pins.
 #define LF 5            // Left forward pin
 #define LR 6            // Left reverse pin
 #define RF 10           // Right forward pin
 #define RR 9            // Right reverse pin
-#define ALEX_LENGTH 16  // alex length
-#define ALEX_BREADTH 6  // alex breath
+
+// Wheel encoder pins, on INT0 and INT1
+#define LEFT_ENCODER_PIN 2
+#define RIGHT_ENCODER_PIN 3
+
+// On-board LED
+#define LED_PIN 13
+
+// Link to the Pi. Other rates are only built for benchmarks, see
+// ../simavr.
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 9600
+#endif
 
 // TCS3200/230 colour sensor pins
 #define S0 0
@@ -44,16 +56,46 @@
 #define S3 7
 #define OUT 8
 
-// Mask definitions for power management
-#define PRR_TWI_MASK 0b10000000
-#define PRR_TIMER2_MASK 0b01000000
-#define PRR_TIMER0_MASK 0b00100000
-#define PRR_SPI_MASK 0b00000100
-#define PRR_ADC_MASK 0b00000001
-#define PRR_TIMER1_MASK 0b00001000
-#define SMCR_SLEEP_ENABLE_MASK 0b00000001
-#define SMCR_IDLE_MODE_MASK 0b00000001
-#define ADCSRA_ADC_MASK 0b1000000
+// Wheel speed control runs from the systick ISR this often
+#define SPEED_PERIOD_MS 20
+#define SPEED_PERIOD_HR (SPEED_PERIOD_MS * 1000UL * HRCLOCK_TICKS_PER_US)
+
+// Wheel speed at 100%, in encoder ticks per second
+#define WHEEL_MAX_TICKS_PER_S 600
+
+// 100% in ticks per SPEED_PERIOD_MS, Q8
+#define SPEED_MAX_Q8 \
+    ((int32_t)WHEEL_MAX_TICKS_PER_S * SPEED_PERIOD_MS * 256 / 1000)
+
+// Moves ramp from standstill to 100% in this long, and brake at the same
+// rate so they reach their tick target at SPEED_CREEP_Q8
+#define SPEED_RAMP_MS 300
+#define SPEED_ACCEL_Q8 (SPEED_MAX_Q8 * SPEED_PERIOD_MS / SPEED_RAMP_MS)
+#define SPEED_CREEP_Q8 (SPEED_MAX_Q8 / 8)
+
+// Braking distance from 100%, v^2 / 2a in ticks. Further out than this no
+// move needs to slow down, which also keeps the braking maths in 32 bits.
+#define SPEED_BRAKE_TICKS \
+    ((int32_t)SPEED_MAX_Q8 * SPEED_MAX_Q8 / (2L * SPEED_ACCEL_Q8 * 256) + 1)
+
+// Open-loop PWM for a speed is speed * SPEED_FF_Q16 >> 16, i.e. 255 at
+// SPEED_MAX_Q8, without a division in the ISR
+#define SPEED_FF_Q16 (255L * 65536 / SPEED_MAX_Q8)
+
+// Telemetry pushes cost one 140 byte frame, i.e. ~146 ms of wire time at
+// 9600 baud, per report. Never schedule them faster than the link drains.
+#define TELEMETRY_MS_PER_REPORT 150
+
+// Scheduler priorities, lower runs first. Stopping on time matters most,
+// then answering the Pi; sensors and reports fill in around them.
+#define PRIORITY_MOTION 0
+#define PRIORITY_PACKETS 1
+#define PRIORITY_COLOUR 2
+#define PRIORITY_TELEMETRY 3
+
+// Periods of the timed tasks. Motion and packets run on every wakeup.
+#define COLOUR_TASK_MS 10
+#define TELEMETRY_TASK_MS 10
 
 // Ultrasonic sensor pins
 #define TRIGGER_PIN 11  // Trigger pin of ultrasonic sensor (orange)
@@ -68,14 +110,39 @@ typedef enum {
     RIGHT = 4
 } TDirection;
 
-volatile TBuffer sendbuf, recvbuf;
+TRingBuffer<RECV_BUF_LEN> recvbuf;
+
+// The one frame being received. Commands are handled straight out of it.
+TFrameParser recvFrame;
+
+// Bytes taken out of recvbuf since the last hello, modulo 256. Sent back
+// in every frame as the Pi's credit, see RECV_WINDOW.
+uint8_t rxTaken = 0;
+
+// Emergency stop lane, see matchStop(). The receive ISR stops the motors
+// as soon as a stop token ends; acknowledgeStop() then drops whatever
+// arrived before it and answers. Worst case, token's last byte to PWM cut:
+//   the worst interrupt latency (simbench)
+//   + the USART_RX ISR, stop() included,
+// measured together by simbench as estop_cycles: well under a ms, however
+// much is queued in recvbuf.
+TStopMatcher stopMatcher;
+volatile uint8_t stopPending = 0;
+volatile char stopSeq;
+volatile uint8_t stopHead;  // recvbuf head just past the token
+
+void stop();
 
 volatile TDirection dir = STOP;
 
-// Alex's diagonal. We compute and store this value once since it is
-// expensive to compute and really does not change
-float alexDiagonal = 0.0;
-float alexCirc = 0.0;
+// Wheel circumference in hundredths of a cm, PARAM_WHEEL_CIRC. Distance
+// traveled is revs * wheelCircCenti.
+unsigned long wheelCircCenti = 0;
+
+// Wheel ticks per degree turned, in 16.16 fixed point. Worked out from the
+// turning circle whenever the parameters change, so turn targets need no
+// float maths.
+unsigned long turnTicksPerDegQ16 = 0;
 
 // Ticks from Alex's left and right encoders.
 volatile unsigned long leftForwardTicks = 0;
@@ -83,6 +150,35 @@ volatile unsigned long rightForwardTicks = 0;
 volatile unsigned long leftReverseTicks = 0;
 volatile unsigned long rightReverseTicks = 0;
 
+// Encoder edges in any direction, and the hrclock time of the latest,
+// for wheel speed. The counts wrap freely.
+volatile uint8_t leftEdges = 0;
+volatile uint8_t rightEdges = 0;
+volatile uint32_t leftEdgeTime = 0;
+volatile uint32_t rightEdgeTime = 0;
+
+// Wheel speeds worked out from those every SPEED_PERIOD_MS, see velocity.h
+TVelocity leftVelocity;
+TVelocity rightVelocity;
+
+// Encoder edges counted up going forwards and down going backwards, for
+// dead reckoning. Also wrap freely.
+volatile uint8_t leftTravel = 0;
+volatile uint8_t rightTravel = 0;
+uint8_t lastLeftTravel;
+uint8_t lastRightTravel;
+
+// Wheel speed control, owned by wheelSpeedTick() while wheelTarget is set.
+// Both wheels chase the same speed, in ticks per SPEED_PERIOD_MS, Q8. The
+// target follows a trapezoidal profile up to wheelCruise and back down as
+// *moveProgress nears moveGoal.
+volatile int16_t wheelTarget = 0;
+int16_t wheelCruise = 0;
+volatile unsigned long* moveProgress;
+unsigned long moveGoal;
+TPid leftPid;
+TPid rightPid;
+
 volatile unsigned long leftForwardTicksTurns = 0;
 volatile unsigned long rightForwardTicksTurns = 0;
 volatile unsigned long leftReverseTicksTurns = 0;
@@ -92,11 +188,8 @@ volatile unsigned long rightReverseTicksTurns = 0;
 volatile unsigned long leftRevs = 0;
 volatile unsigned long rightRevs = 0;
 
-// Forward and backward distance traveled
-volatile unsigned long forwardDist = 0;
-volatile unsigned long reverseDist = 0;
-
-// Variables to keep track of whether we have moved a command distance
+// Variables to keep track of whether we have moved a command distance.
+// Both are in left wheel ticks so the encoder ISRs only ever count.
 volatile unsigned long deltaDist = 0;
 volatile unsigned long newDist = 0;
 
@@ -113,539 +206,519 @@ volatile unsigned long green = 0;
 volatile unsigned long
     colour;  // 'u' for unknown, 'r' for red and 'g' for green
 
-// Ultrasonic sensor reading
-volatile int near = 0;  // 0 for not very near and 1 for very near
+// Telemetry subscription: which TTelemetryType reports to push, how often
+// (in ms) and when we last pushed them. A mask of 0 means unsubscribed.
+// telemetryFields is the TStatusField mask for TELEMETRY_FIELDS.
+uint8_t telemetryMask = 0;
+uint8_t telemetryFields = 0;
+uint32_t telemetryPeriod = 0;
+uint32_t lastTelemetry = 0;
+
+// Sequence tag of the command being handled, echoed in every reply so the Pi
+// can match them up. 0 marks replies nobody asked for, like telemetry.
+char replySeq = 0;
+
+// Transmit slot the reply under construction lives in
+char* replyFrame;
+
+// Link counters since reset, for STATUS_LINK. The receive ISR counts the
+// bytes it drops on a full recvbuf, the packet task the rest.
+uint32_t rxFrames = 0;
+uint32_t rxBadPackets = 0;
+uint32_t rxBadChecksums = 0;
+volatile uint16_t rxDropped = 0;
+
+// Power down what Alex never uses, and pick IDLE as the sleep mode.
+// Timer0 is gated separately, while the motors are stopped; Timer1, Timer2
+// and the USART run all the time, see waitForEvent().
+void setupPowerSaving() {
+    halPowerSaving();
 
-void WDT_off(void) {
-    // Global interrupt should be turned OFF here if not already done so
-    cli();
+    // Turn off the LED tied to Arduino's Pin 13
+    halPinOutput(LED_PIN);
+    halPinWrite(LED_PIN, 0);
+}
 
-    // Clear WDRF in MCUSR
-    MCUSR &= ~(1 << WDRF);
+// Sleep in IDLE until an interrupt leaves loop() something to do: a
+// received byte, an encoder edge, or a timer (systick, ranging, colour
+// capture, UART transmit). Received bytes still waiting mean there is work
+// already, so do not sleep at all.
+void waitForEvent() {
+    halIrqDisable();
 
-    // Write logical one to WDCE and WDE
-    // Keep old prescaler setting to prevent unintentional time-out
-    WDTCSR |= (1 << WDCE) | (1 << WDE);
+    if (ringCount(&recvbuf) == 0) {
+        halSleep();
+    }
 
-    // Turn off WDT
-    WDTCSR = 0x00;
+    halIrqEnable();
+}
 
-    // Global interrupt should be turned ON here if subsequent operations
-    // after calling this function do not require turning off global interrupt
-    sei();
+// Alex Communication Routines.
+// Parse received bytes straight out of recvbuf into recvFrame. On PACKET_OK
+// "*packet" points into recvFrame, valid until the next readPacket().
+TResult readPacket(TPacket** packet) {
+    const unsigned char* span;
+    uint16_t len;
+    int used;
+
+    // At most two spans, when the received bytes wrap around the ring
+    while ((len = ringPeek(&recvbuf, &span)) > 0) {
+        TResult result = parseFrame(&recvFrame, (const char*)span, len, &used);
+        ringSkip(&recvbuf, used);
+        rxTaken += used;
+
+        if (result != PACKET_INCOMPLETE) {
+            *packet = (TPacket*)framePayload(&recvFrame);
+            return result;
+        }
+    }
+
+    return PACKET_INCOMPLETE;
 }
 
-void setupPowerSaving() {
-    // Turn off the Watchdog Timer
-    WDT_off();
+// Replies are built in place in a transmit slot rather than on the stack.
+// startReply() waits for a free slot and returns the packet inside it,
+// with the header filled in and the rest zeroed, so nothing the slot last
+// sent goes out again; fill in the rest and call sendReply().
+TPacket* startReply(char packetType, char command) {
+    replyFrame = txAcquire(1);
+
+    TPacket* reply = (TPacket*)frameData(replyFrame);
+    reply->packetType = packetType;
+    reply->command = command;
+    reply->seq = replySeq;
+    reply->credit = rxTaken;
+    memset(reply->data, 0, sizeof(TPacket) - offsetof(TPacket, data));
+
+    return reply;
+}
+
+void sendReply() {
+    txSubmit(serializeInPlace(replyFrame, sizeof(TPacket)));
+}
 
-    // Modify PRR to shut down TWI
-    PRR |= PRR_TWI_MASK;
+// ACK or NACK: a reply that is only its header goes out as a compact
+// frame, 10 bytes on the wire rather than 140
+void sendAck(char packetType, char command) {
+    char header[offsetof(TPacket, data)] = {packetType, command, replySeq,
+                                            (char)rxTaken};
 
-    // Modify PRR to shut down SPI
-    PRR |= PRR_SPI_MASK;
+    replyFrame = txAcquire(1);
+    txSubmit(serializeCompact(replyFrame, header, sizeof(header)));
+}
 
-    // Modify ADCSRA to disable ADC,
-    // then modify PRR to shut down ADC
-    ADCSRA |= ADCSRA_ADC_MASK;
-    PRR |= PRR_ADC_MASK;
+// Bring red, green, blue and colour up to date
+void sampleColour() {
+    // The colour sampler measures in the background, see colour.h. Just
+    // take its latest complete reading instead of blocking for 60 ms.
+    TColourSample sample;
+    if (readColourSample(&sample)) {
+        red = sample.red;
+        green = sample.green;
+        blue = sample.blue;
+    }
 
-    // Set the SMCR to choose the IDLE sleep mode
-    // Do not set the Sleep Enable (SE) bit yet
-    SMCR &= SMCR_IDLE_MODE_MASK;
+    // Darren's calibration in lab
+    // if (Red <= 30 && Green <=15 && Blue <= 15)
+    // colour = 0; // strcpy(colour, "White");
+    //  if (Red >= 30 && Blue >= 30 && Green >= 30)
+    //    colour = 1; // strcpy(colour, "Red");
+    //  else if (Green <= 29 && Red <= 29 && Blue <= 29)
+    //    colour = 2; // strcpy(colour, "Green");
 
-    // Set Port B Pin 5 as output pin, then write a logic LOW to it such
-    // that the LED tied to Arduino's Pin 13 is OFF.
-    DDRB |= 0b00100000;
-    PORTB &= 0b11011111;
+    // Default calibration
+    if (red < blue && red <= green && red < getParam(PARAM_RED_MAX) &&
+        green > getParam(PARAM_RED_GREEN_MIN)) {
+        colour = 1;  // red
+    } else if (green < red &&
+               green - blue <= getParam(PARAM_GREEN_BLUE_MAX)) {
+        colour = 2;  // green
+    } else {
+        colour = 0;
+    }
 }
 
-void putArduinoToIdle() {
-    // Modify PRR to shut down TIMER 0, 1 and 2
-    PRR |= PRR_TIMER0_MASK;
-    PRR |= PRR_TIMER1_MASK;
-    PRR |= PRR_TIMER2_MASK;
+void sendStatus() {
+    // Implement code to send back a packet containing some parameters listed
+    // below The params array stores the parameters with set packetType and
+    // command files sendReply sends out the packet.
+    PROFILE_BEGIN(PROFILE_SEND_STATUS);
+
+    TPacket* statusPacket = startReply(PACKET_TYPE_RESPONSE, RESP_STATUS);
+    //  statusPacket->params[0] = leftForwardTicks;
+    //  statusPacket->params[1] = rightForwardTicks;
+    //  statusPacket->params[2] = leftReverseTicks;
+    //  statusPacket->params[3] = rightReverseTicks;
+    //  statusPacket->params[4] = leftForwardTicksTurns;
+    //  statusPacket->params[5] = rightForwardTicksTurns;
+    //  statusPacket->params[6] = leftReverseTicksTurns;
+    //  statusPacket->params[7] = rightReverseTicksTurns;
+    //  statusPacket->params[8] = forwardDist;
+    //  statusPacket->params[9] = reverseDist;
+
+    sampleColour();
+    statusPacket->params[0] = colour;
+    // delay(200);
 
-    // Modify SE bit in SMCR to enable (i.e., allow) sleep
-    SMCR |= SMCR_SLEEP_ENABLE_MASK;
+    statusPacket->params[1] = red;
+    statusPacket->params[2] = green;
+    statusPacket->params[3] = blue;
 
-    // The following function puts ATmega328P's MCU into sleep;
-    // it wakes up from sleep when USART serial data arrives sleep_cpu();
-    sleep_cpu();
+    statusPacket->params[4] = ultrasonicDistance();
 
-    // Modify SE bit in SMCR to disable (i.e., disallow) sleep
-    SMCR &= (~SMCR_SLEEP_ENABLE_MASK);
+    sendReply();
 
-    // Modify PRR to power up TIMER 0, 1, and 2
-    PRR &= (~PRR_TIMER0_MASK);
-    PRR &= (~PRR_TIMER1_MASK);
-    PRR &= (~PRR_TIMER2_MASK);
+    PROFILE_END(PROFILE_SEND_STATUS);
 }
 
-void pwmWrite(uint8_t pin, int val) {
-    volatile uint8_t* timer_comp;
+// Read a tick counter the encoder ISRs may be updating halfway through
+unsigned long readTicks(volatile unsigned long* ticks) {
+    uint8_t state = halIrqSave();
+    unsigned long value = *ticks;
+    halIrqRestore(state);
 
-    switch (pin) {
-        case LF:
-            timer_comp = &OCR0B;
-            break;
+    return value;
+}
 
-        case LR:
-            timer_comp = &OCR0A;
-            break;
+// Distance in whole cm covered by "ticks" wheel ticks
+unsigned long ticksToCm(unsigned long ticks) {
+    return ticks * wheelCircCenti / (COUNTS_PER_REV * 100UL);
+}
 
-        case RF:
-            timer_comp = &OCR1AL;
-            break;
+// Fewest wheel ticks that cover at least "cm" cm
+unsigned long cmToTicks(unsigned long cm) {
+    return (cm * COUNTS_PER_REV * 100UL + wheelCircCenti - 1) /
+           wheelCircCenti;
+}
 
-        case RR:
-            timer_comp = &OCR1BL;
-            break;
+void sendTicks() {
+    // Encoder counters and distances, cheap to gather unlike the sensors.
+    TPacket* ticksPacket = startReply(PACKET_TYPE_RESPONSE, RESP_TICKS);
+    ticksPacket->params[0] = readTicks(&leftForwardTicks);
+    ticksPacket->params[1] = readTicks(&rightForwardTicks);
+    ticksPacket->params[2] = readTicks(&leftReverseTicks);
+    ticksPacket->params[3] = readTicks(&rightReverseTicks);
+    ticksPacket->params[4] = readTicks(&leftForwardTicksTurns);
+    ticksPacket->params[5] = readTicks(&rightForwardTicksTurns);
+    ticksPacket->params[6] = readTicks(&leftReverseTicksTurns);
+    ticksPacket->params[7] = readTicks(&rightReverseTicksTurns);
+    ticksPacket->params[8] = ticksToCm(ticksPacket->params[0]);
+    ticksPacket->params[9] = ticksToCm(ticksPacket->params[2]);
+
+    sendReply();
+}
 
-        default:
-            return;
+// x and y of a pose, Q8 ticks, in 0.1 mm: whole ticks and the fraction
+// separately, so nothing overflows 32 bits within a few hundred metres
+int32_t poseToTenthMm(int32_t q8) {
+    int32_t ticks = q8 >> 8;
+    int32_t fraction = q8 & 0xFF;
+
+    return (ticks * (int32_t)wheelCircCenti +
+            ((fraction * (int32_t)wheelCircCenti) >> 8)) /
+           COUNTS_PER_REV;
+}
+
+// Dead-reckoned pose, see pose.h, and start again from the origin if
+// "reset"
+void sendPose(int reset) {
+    TPose pose;
+    readPose(&pose);
+    if (reset) {
+        resetPose();
     }
-    *timer_comp = val;
+
+    TPacket* posePacket = startReply(PACKET_TYPE_RESPONSE, RESP_POSE);
+    posePacket->params[0] = poseToTenthMm(pose.x);
+    posePacket->params[1] = poseToTenthMm(pose.y);
+    posePacket->params[2] = pose.heading >> 16;
+
+    sendReply();
 }
 
-// Read the serial port. Return the read character in
-// ch if available. Also return TRUE if ch is valid.
-int readSerial(char* buffer) {
-    int count = 0;
+// A wheel speed in ticks per s, Q8, for the Pi
+uint32_t speedPerSecond(const TVelocity* velocity) {
+    uint8_t state = halIrqSave();
+    int16_t speed = velocity->speed;
+    halIrqRestore(state);
+
+    return (uint32_t)speed * (1000 / SPEED_PERIOD_MS);
+}
 
-    for (count = 0; dataAvailable(&recvbuf); count += 1) {
-        readBuffer(&recvbuf, (unsigned char*)&buffer[count]);
+// Only the TStatusField fields in "mask", see COMMAND_GET_FIELDS. Nothing
+// outside them is read, and the reply goes out compact, cut off after the
+// last value: a range check is 50 bytes on the wire rather than 140.
+void sendFields(uint32_t mask) {
+    TPacket* fieldsPacket = startReply(PACKET_TYPE_RESPONSE, RESP_FIELDS);
+    uint32_t* params = fieldsPacket->params;
+    const uint8_t room = sizeof(fieldsPacket->params) / sizeof(uint32_t);
+    uint32_t sent = 0;
+    uint8_t n = 1;
+
+    if ((mask & STATUS_COLOUR) && n + 4 <= room) {
+        sampleColour();
+        params[n++] = colour;
+        params[n++] = red;
+        params[n++] = green;
+        params[n++] = blue;
+        sent |= STATUS_COLOUR;
     }
 
-    return count;
+    if ((mask & STATUS_RANGE) && n + 1 <= room) {
+        params[n++] = ultrasonicDistance();
+        sent |= STATUS_RANGE;
+    }
+
+    if ((mask & STATUS_TICKS) && n + 8 <= room) {
+        params[n++] = readTicks(&leftForwardTicks);
+        params[n++] = readTicks(&rightForwardTicks);
+        params[n++] = readTicks(&leftReverseTicks);
+        params[n++] = readTicks(&rightReverseTicks);
+        params[n++] = readTicks(&leftForwardTicksTurns);
+        params[n++] = readTicks(&rightForwardTicksTurns);
+        params[n++] = readTicks(&leftReverseTicksTurns);
+        params[n++] = readTicks(&rightReverseTicksTurns);
+        sent |= STATUS_TICKS;
+    }
+
+    if ((mask & STATUS_DISTANCE) && n + 2 <= room) {
+        params[n++] = ticksToCm(readTicks(&leftForwardTicks));
+        params[n++] = ticksToCm(readTicks(&leftReverseTicks));
+        sent |= STATUS_DISTANCE;
+    }
+
+    if ((mask & STATUS_POSE) && n + 3 <= room) {
+        TPose pose;
+        readPose(&pose);
+        params[n++] = poseToTenthMm(pose.x);
+        params[n++] = poseToTenthMm(pose.y);
+        params[n++] = pose.heading >> 16;
+        sent |= STATUS_POSE;
+    }
+
+    if ((mask & STATUS_LINK) && n + 4 <= room) {
+        uint8_t state = halIrqSave();
+        uint16_t dropped = rxDropped;
+        halIrqRestore(state);
+
+        params[n++] = rxFrames;
+        params[n++] = rxBadPackets;
+        params[n++] = rxBadChecksums;
+        params[n++] = dropped;
+        sent |= STATUS_LINK;
+    }
+
+    if ((mask & STATUS_SPEED) && n + 2 <= room) {
+        params[n++] = speedPerSecond(&leftVelocity);
+        params[n++] = speedPerSecond(&rightVelocity);
+        sent |= STATUS_SPEED;
+    }
+
+    params[0] = sent;
+    txSubmit(serializeCompact(replyFrame, fieldsPacket,
+                              offsetof(TPacket, params) + n * 4));
 }
 
-// Write to the serial port.
-void writeSerial(const char* buffer, int len) {
-    for (int i = 0; i < len; i += 1) {
-        writeBuffer(&sendbuf, buffer[i]);
+void sendParams() {
+    TPacket* paramsPacket = startReply(PACKET_TYPE_RESPONSE, RESP_PARAMS);
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        paramsPacket->params[i] = getParam((TParam)i);
     }
 
-    sbi(UCSR0B, UDRIE0);
+    sendReply();
 }
 
-// Alex Communication Routines.
-TResult readPacket(TPacket* packet) {
-    // Read in data from the serial port and
-    // deserialize it.Return deserialized
-    // data in "packet".
-    char buffer[PACKET_SIZE];
+// Scheduler ids of the TFirmwareTask tasks, from addTask()
+static uint8_t taskIds[TASK_COUNT];
 
-    int len = readSerial(buffer);
+// Send the scheduler's statistics, see TFirmwareTask
+void sendTasks() {
+    static_assert(TASK_COUNT * 4 <= 16, "task stats must fit in params");
 
-    if (len == 0) {
-        return PACKET_INCOMPLETE;
-    } else {
-        return deserialize(buffer, len, packet);
-    }
-}
-
-void sendResponse(TPacket* packet) {
-    // Take a packet, serialize it then send it out
-    // over the serial port.
-    char buffer[PACKET_SIZE];
-    int len;
-
-    len = serialize(buffer, packet, sizeof(TPacket));
-    writeSerial(buffer, len);
-}
-
-#define pulseWidth(sfr, bit)                                                                                          \
-    __extension__({                                                                                                   \
-        const uint8_t initial = rbi(sfr, bit);                                                                        \
-        while (rbi(sfr, bit) == initial)                                                                              \
-            ; /*  for last pulse to end  */                                                                           \
-        while (rbi(sfr, bit) != initial)                                                                              \
-            ; /*  for next pulse to begin  */                                                                         \
-        volatile uint32_t width =                                                                                     \
-            0; /*sufficient to provide 2^32/16M=268s of count*/                                                       \
-        /*                                                                                                            \
-        while (rbi(sfr, bit) == initial) {                                                                            \
-            width += 1;                                                                                               \
-        }                                                                                                             \
-        */                                                                                                            \
-        __asm__ volatile ( /*  prevent compiler from optimize this since the timing of instructions is critical  */ \
-        /*  first zero them out  */ \
-        "clr r24 \n\t" \
-        "clr r25 \n\t" \
-        "clr r26 \n\t" \
-        "clr r27 \n\t" \
-		/*  begin loop  */ \
-        "wait_while_%=: \n\t" /*  prevent name collision  */ \
-        /*  use special high reg pairs to take space advantage of word operations  */ \
-        /*  increment the 32 bits by 1  */ \
-        "adiw r24,1 \n\t" \
-        "adc r26,__zero_reg__ \n\t" \
-        "adc r27,__zero_reg__ \n\t" \
-        /*  branching  */ \
-        "in __tmp_reg__,%[pinb] \n\t" /*  read pind, clock: 1  */ \
-        "and __tmp_reg__,%[initial] \n\t" \
-        "cp __tmp_reg__,__zero_reg__ \n\t" \
-        "breq wait_while_%= \n\t" /*  continue loop if still unchanged  */ \
-		/*  end loop  */ \
-        /*  move back  */ \
-        "movw %A[width],r24 \n\t" \
-        "movw %C[width],r26 \n\t" \
-        : [width] "=r" (width) \
-        : [pinb] "I" (_SFR_IO_ADDR(sfr)), [initial] "r" (initial) \
-        : "r24", "r25", "r26", "r27" /*  clobber list  */ \
-    ); \
-        width * 9 * 1000000 / F_CPU;                                                                                  \
-    })
-
-long microsecondsToCentimeters(long microseconds) {
-    return microseconds / 29 / 2;
-}
-
-int calculateUltrasonic() {
-    long duration, distance;
-
-    DDRB |= 0b00001000;
-    // pinMode(TRIGGER_PIN, OUTPUT);
-    PORTB &= 0b11110111;
-    // digitalWrite(TRIGGER_PIN, LOW);
-    _delay_us(2);
-    PORTB |= 0b00001000;
-    // digitalWrite(TRIGGER_PIN, HIGH);
-    _delay_us(10);
-    PORTB &= 0b11110111;
-    // digitalWrite(TRIGGER_PIN, LOW);
-    DDRB &= 0b11101111;
-    // pinMode(ECHO_PIN, INPUT);
-    duration = pulseWidth(PINB, PINB4);
-    distance = microsecondsToCentimeters(duration);
-
-    // Serial.print(distance);
-    // Serial.print("cm");
-    if (distance <= 6) {
-        // Serial.print(" Too Close!!!");
-        near = 1;
-    } else {
-        near = 0;
+    TPacket* tasksPacket = startReply(PACKET_TYPE_RESPONSE, RESP_TASKS);
+
+    for (uint8_t i = 0; i < TASK_COUNT; i++) {
+        TTaskStats stats;
+        if (!taskStats(taskIds[i], &stats)) {
+            continue;
+        }
+
+        tasksPacket->params[4 * i] = stats.runs;
+        tasksPacket->params[4 * i + 1] = stats.missed;
+        tasksPacket->params[4 * i + 2] = stats.lastTime;
+        tasksPacket->params[4 * i + 3] = stats.maxTime;
     }
 
-    return distance;
-    // Serial.println();
-    // delay(100);
+    sendReply();
 }
 
-void sendStatus() {
-    // Implement code to send back a packet containing some parameters listed
-    // below The params array stores the parameters with set packetType and
-    // command files sendResponse sends out the packet.
-    TPacket statusPacket;
-    statusPacket.packetType = PACKET_TYPE_RESPONSE;
-    statusPacket.command = RESP_STATUS;
-    //  statusPacket.params[0] = leftForwardTicks;
-    //  statusPacket.params[1] = rightForwardTicks;
-    //  statusPacket.params[2] = leftReverseTicks;
-    //  statusPacket.params[3] = rightReverseTicks;
-    //  statusPacket.params[4] = leftForwardTicksTurns;
-    //  statusPacket.params[5] = rightForwardTicksTurns;
-    //  statusPacket.params[6] = leftReverseTicksTurns;
-    //  statusPacket.params[7] = rightReverseTicksTurns;
-    //  statusPacket.params[8] = forwardDist;
-    //  statusPacket.params[9] = reverseDist;
-
-    // S2/S3 levels define which set of photodiodes we are using.
-    // LOW/LOW is for RED LOW/HIGH is for Blue and HIGH/HIGH is for green
-    // Here we wait until "out" go LOW, we start measuring the duration and stop
-    // when "out" is HIGH again
-
-    // Bare-metal version
-    PORTD &= 0b01101111;
-    red = pulseWidth(PINB, PINB0);
-    _delay_ms(20);
-    PORTD |= 0b10000000;
-    blue = pulseWidth(PINB, PINB0);
-    _delay_ms(20);
-    PORTD |= 0b00010000;
-    green = pulseWidth(PINB, PINB0);
-    _delay_ms(20);
-
-    /*
-// Sketch version
-digitalWrite(S2, LOW);
-digitalWrite(S3, LOW);
-red = pulseIn(OUT, digitalRead(OUT) == HIGH ? LOW : HIGH);
-delay(20);
-digitalWrite(S3, HIGH);
-blue = pulseIn(OUT, digitalRead(OUT) == HIGH ? LOW : HIGH);
-delay(20);
-digitalWrite(S2, HIGH);
-green = pulseIn(OUT, digitalRead(OUT) == HIGH ? LOW : HIGH);
-delay(20);
-    */
+#ifdef PROFILE
+// Send the profile, see TProfileRegion, and start a new one if "clear"
+void sendProfile(int clear) {
+    static_assert(PROFILE_REGIONS * 4 <= 16, "profile must fit in params");
 
-    // Darren's calibration in lab
-    // if (Red <= 30 && Green <=15 && Blue <= 15)
-    // colour = 0; // strcpy(colour, "White");
-    //  if (Red >= 30 && Blue >= 30 && Green >= 30)
-    //    colour = 1; // strcpy(colour, "Red");
-    //  else if (Green <= 29 && Red <= 29 && Blue <= 29)
-    //    colour = 2; // strcpy(colour, "Green");
+    TPacket* profilePacket = startReply(PACKET_TYPE_RESPONSE, RESP_PROFILE);
 
-    // Default calibration
-    if (red < blue && red <= green && red < 22 && green > 35) {
-        colour = 1;  // red
-    } else if (green < red && green - blue <= 8) {
-        colour = 2;  // green
-    } else {
-        colour = 0;
-    }
-    statusPacket.params[0] = colour;
-    // delay(200);
+    for (uint8_t i = 0; i < PROFILE_REGIONS; i++) {
+        TProfileStats stats;
+        profileRead((TProfileRegion)i, &stats);
 
-    statusPacket.params[1] = red;
-    statusPacket.params[2] = green;
-    statusPacket.params[3] = blue;
+        profilePacket->params[4 * i] = stats.calls;
+        profilePacket->params[4 * i + 1] = stats.minCycles;
+        profilePacket->params[4 * i + 2] = stats.avgCycles;
+        profilePacket->params[4 * i + 3] = stats.maxCycles;
+    }
 
-    int distance = calculateUltrasonic();
-    statusPacket.params[4] = distance;
+    if (clear) {
+        profileClear();
+    }
 
-    sendResponse(&statusPacket);
+    sendReply();
 }
+#endif
 
 void sendMessage(const char* message) {
     // Send text messages back to the Pi. Useful for debugging.
-    TPacket messagePacket;
-
-    messagePacket.packetType = PACKET_TYPE_MESSAGE;
-    strncpy(messagePacket.data, message, MAX_STR_LEN);
-    sendResponse(&messagePacket);
+    TPacket* messagePacket = startReply(PACKET_TYPE_MESSAGE, 0);
+    strncpy(messagePacket->data, message, MAX_STR_LEN - 1);
+    messagePacket->data[MAX_STR_LEN - 1] = '\0';
+    sendReply();
 }
 
 void dbprint(const char* format, ...) {
+    // Format straight into the message, cut short at MAX_STR_LEN
+    TPacket* messagePacket = startReply(PACKET_TYPE_MESSAGE, 0);
     va_list args;
-    char buffer[128];
 
     va_start(args, format);
-    vsprintf(buffer, format, args);
-    sendMessage(buffer);
+    vsnprintf(messagePacket->data, MAX_STR_LEN, format, args);
+    va_end(args);
+    sendReply();
 }
 
 void sendBadPacket() {
     // Tell the Pi that it sent us a packet with a bad magic number.
-    TPacket badPacket;
-
-    badPacket.packetType = PACKET_TYPE_ERROR;
-    badPacket.command = RESP_BAD_PACKET;
-    sendResponse(&badPacket);
+    sendAck(PACKET_TYPE_ERROR, RESP_BAD_PACKET);
 }
 
 void sendBadChecksum() {
     // Tell the Pi that it sent us a packet with a bad checksum.
-    TPacket badChecksum;
-
-    badChecksum.packetType = PACKET_TYPE_ERROR;
-    badChecksum.command = RESP_BAD_CHECKSUM;
-    sendResponse(&badChecksum);
+    sendAck(PACKET_TYPE_ERROR, RESP_BAD_CHECKSUM);
 }
 
 void sendBadCommand() {
     // Tell the Pi that we don't understand its command sent to us.
-    TPacket badCommand;
+    sendAck(PACKET_TYPE_ERROR, RESP_BAD_COMMAND);
+}
 
-    badCommand.packetType = PACKET_TYPE_ERROR;
-    badCommand.command = RESP_BAD_COMMAND;
-    sendResponse(&badCommand);
+void sendBadParam() {
+    // A parameter that does not exist, or a value out of its range
+    sendAck(PACKET_TYPE_ERROR, RESP_BAD_PARAM);
 }
 
 void sendBadResponse() {
-    TPacket badResponse;
-
-    badResponse.packetType = PACKET_TYPE_ERROR;
-    badResponse.command = RESP_BAD_RESPONSE;
-    sendResponse(&badResponse);
+    sendAck(PACKET_TYPE_ERROR, RESP_BAD_RESPONSE);
 }
 
 void sendOK() {
-    TPacket okPacket;
-
-    okPacket.packetType = PACKET_TYPE_RESPONSE;
-    okPacket.command = RESP_OK;
-    sendResponse(&okPacket);
+    sendAck(PACKET_TYPE_RESPONSE, RESP_OK);
 }
 
 // Setup and start codes for external interrupts and pullup resistors.
 // Enable pull up resistors on pins 2 and 3
 void enablePullups() {
-    // Enable the pull-up resistors on pins 2 and 3. These are pins PD2 and PD3
-    // respectively. Set bits 2 and 3 in DDRD to 0 to make them inputs.
-    DDRD &= 0b11110011;
-
-    // PIND |= 0b110;
-    PORTD |= 0b00001100;
+    halPinInputPullup(LEFT_ENCODER_PIN);
+    halPinInputPullup(RIGHT_ENCODER_PIN);
 }
 
 // Functions to be called by INT0 and INT1 ISRs.
+// Only count here: distances are worked out from the ticks when needed and
+// move targets are converted to ticks up front, so no float maths (hundreds
+// of cycles each on the FPU-less ATmega328P) runs inside the interrupt.
 void leftISR() {
+    PROFILE_BEGIN(PROFILE_LEFT_ISR);
+
+    leftEdges++;
+    leftEdgeTime = hrClockNow();
+
     if (dir == FORWARD) {
         leftForwardTicks++;
-        forwardDist = (unsigned long)((float)leftForwardTicks / COUNTS_PER_REV *
-                                      WHEEL_CIRC);
+        leftTravel++;
     } else if (dir == BACKWARD) {
         leftReverseTicks++;
-        reverseDist = (unsigned long)((float)leftReverseTicks / COUNTS_PER_REV *
-                                      WHEEL_CIRC);
+        leftTravel--;
     } else if (dir == LEFT) {
         leftReverseTicksTurns++;
+        leftTravel--;
     } else if (dir == RIGHT) {
         leftForwardTicksTurns++;
+        leftTravel++;
     }
+
+    PROFILE_END(PROFILE_LEFT_ISR);
 }
 
 void rightISR() {
+    rightEdges++;
+    rightEdgeTime = hrClockNow();
+
     if (dir == FORWARD) {
         rightForwardTicks++;
+        rightTravel++;
     } else if (dir == BACKWARD) {
         rightReverseTicks++;
+        rightTravel--;
     } else if (dir == LEFT) {
         rightForwardTicksTurns++;
+        rightTravel++;
     } else if (dir == RIGHT) {
         rightReverseTicksTurns++;
+        rightTravel--;
     }
 }
 
 // Set up the external interrupt pins INT0 and INT1 for falling edge triggered.
 void setupEINT() {
-    // Configure pins 2 and 3 to be falling edge triggered.
-    // Enable INT0 and INT1 interrupts.
-    EIMSK |= 0b11;
-    EICRA = 0b1010;
+    halExtIntSetup();
 }
 
-// Implement the external interrupt ISRs.
-// INT0 ISR should call leftISR while INT1 ISR should call rightISR.
-ISR(INT0_vect) {
+// INT0 should call leftISR while INT1 should call rightISR.
+void halExtInt0Handler() {
     leftISR();
 }
 
-ISR(INT1_vect) {
+void halExtInt1Handler() {
     rightISR();
 }
 
-// Setup and start codes for serial communications
-// Set up the serial connection.
+// Set up the serial connection, and start receiving into recvbuf.
 void setupSerial() {
-    initBuffer(&sendbuf, BUF_LEN);
-    initBuffer(&recvbuf, BUF_LEN);
-
-    // async
-    cbi(UCSR0C, UMSEL00);
-    cbi(UCSR0C, UMSEL01);
-    cbi(UCSR0C, UCPOL0);
-
-    // parity: none
-    cbi(UCSR0C, UPM00);
-    cbi(UCSR0C, UPM01);
-
-    // stop bit: 1
-    cbi(UCSR0C, USBS0);
-
-    // data size: 8
-    sbi(UCSR0C, UCSZ00);
-    sbi(UCSR0C, UCSZ01);
-    cbi(UCSR0B, UCSZ02);
-    cbi(UCSR0B, TXB80);
-
-    // baud rate: 9600
-    uint16_t b = F_CPU / 16 / 9600 - 1;
-    UBRR0H = (uint8_t)(b >> 8);
-    UBRR0L = (uint8_t)b;
-
-    // single processor, normal transmission speed
-    cbi(UCSR0A, MPCM0);
-    cbi(UCSR0A, U2X0);
+    recvFrame.stuffed = 1;
+    halUartSetup(SERIAL_BAUD);
 }
 
-ISR(USART_RX_vect) {
-    unsigned char data = UDR0;
-
-    writeBuffer(&recvbuf, data);
-}
+void halUartRxHandler(uint8_t data) {
+    PROFILE_BEGIN(PROFILE_USART_RX);
 
-ISR(USART_UDRE_vect) {
-    unsigned char data;
-
-    if (readBuffer(&sendbuf, &data) == BUFFER_OK) {
-        UDR0 = data;
-    } else {
-        cbi(UCSR0B, UDRIE0);
+    if (ringPut(&recvbuf, data) != BUFFER_OK) {
+        rxDropped++;
     }
-}
 
-// Start the serial connection.
-void startSerial() {
-    // enable rx and tx
-    sbi(UCSR0B, TXEN0);
-    sbi(UCSR0B, RXEN0);
+    if (matchStop(&stopMatcher, data)) {
+        stop();
+        dir = STOP;
+        stopSeq = stopMatcher.seq;
+        stopHead = recvbuf.head;
+        stopPending = 1;
+    }
 
-    // enable interrupts
-    cbi(UCSR0B, TXCIE0);
-    sbi(UCSR0B, RXCIE0);
-    cbi(UCSR0B, UDRIE0);  // data reg empty interrupt
+    PROFILE_END(PROFILE_USART_RX);
 }
 
 // Alex's motor drivers.
 // Set up the PWMs to drive the motors.
 void setupMotors() {
-    // set as output
-    DDRB |= 0b110;
-    DDRD |= 0b1100000;
-
-    // No prescaling, max freq
-    sbi(TCCR0B, CS00);
-    cbi(TCCR0B, CS01);
-    cbi(TCCR0B, CS02);
-    sbi(TCCR1B, CS10);
-    cbi(TCCR1B, CS11);
-    cbi(TCCR1B, CS12);
-
-    // initialise counter
-    TCNT0 = 0;
-    TCNT1L = 0;
-    TCNT1H = 0;
-    OCR0A = 0;
-    OCR0B = 0;
-    OCR1AL = 0;
-    OCR1AH = 0;
-    OCR1BL = 0;
-    OCR1BH = 0;
-
-    // phase correct
-    sbi(TCCR0A, WGM00);
-    cbi(TCCR0A, WGM01);
-    cbi(TCCR0B, WGM02);
-    sbi(TCCR1A, WGM10);
-    cbi(TCCR1A, WGM11);
-    cbi(TCCR1B, WGM12);
-    cbi(TCCR1B, WGM13);
-
-    /* Our motor set up is:
-       A1IN - Pin 5, PD5, OC0B
-       A2IN - Pin 6, PD6, OC0A
-       B1IN - Pin 9, PB1, OC1A
-       B2IN - Pin 10, PB2, OC1B
-    */
-}
-
-// Start the PWM for Alex's motors.
-void startMotors() {
-    // clear on compare, non-inverted
-    cbi(TCCR0A, COM0A0);
-    sbi(TCCR0A, COM0A1);
-    cbi(TCCR0A, COM0B0);
-    sbi(TCCR0A, COM0B1);
-    cbi(TCCR1A, COM1A0);
-    sbi(TCCR1A, COM1A1);
-    cbi(TCCR1A, COM1B0);
-    sbi(TCCR1A, COM1B1);
+    halPwmSetup();
 }
 
 // Convert percentages to PWM values
@@ -661,6 +734,160 @@ int pwmVal(float speed) {
     return (int)((speed / 100.0) * 255.0);
 }
 
+// Drive each wheel with its PWM value, in the sense "dir" needs: forward
+// both wheels forward, and so on. Turning left reverses the left wheel and
+// turning right reverses the right one.
+void driveWheels(int leftVal, int rightVal) {
+    switch (dir) {
+        case FORWARD:
+            halPwmWrite(LF, leftVal);
+            halPwmWrite(RF, rightVal);
+            halPwmWrite(LR, 0);
+            halPwmWrite(RR, 0);
+            break;
+
+        case BACKWARD:
+            halPwmWrite(LR, leftVal);
+            halPwmWrite(RR, rightVal);
+            halPwmWrite(LF, 0);
+            halPwmWrite(RF, 0);
+            break;
+
+        case LEFT:
+            halPwmWrite(LR, leftVal);
+            halPwmWrite(RF, rightVal);
+            halPwmWrite(LF, 0);
+            halPwmWrite(RR, 0);
+            break;
+
+        case RIGHT:
+            halPwmWrite(LF, leftVal);
+            halPwmWrite(RR, rightVal);
+            halPwmWrite(LR, 0);
+            halPwmWrite(RF, 0);
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Next speed target on the trapezoidal profile. Speeds up by
+// SPEED_ACCEL_Q8 a period towards wheelCruise, unless that would make the
+// goal too close to brake for (v^2 > 2ad, with v and a in Q8), and slows
+// down once it is. Never drops below creep speed, or the cruise speed if
+// that is slower, so the move still ends on its tick target.
+int16_t profileSpeed(int16_t speed) {
+    unsigned long done = *moveProgress;
+    unsigned long remaining = moveGoal > done ? moveGoal - done : 0;
+
+    if (remaining >= SPEED_BRAKE_TICKS) {
+        speed += SPEED_ACCEL_Q8;
+        return speed > wheelCruise ? wheelCruise : speed;
+    }
+
+    int32_t brake = 2L * SPEED_ACCEL_Q8 * 256 * remaining;
+    int16_t faster = speed + SPEED_ACCEL_Q8;
+
+    if ((int32_t)speed * speed > brake) {
+        speed -= SPEED_ACCEL_Q8;
+    } else if (speed < wheelCruise && (int32_t)faster * faster <= brake) {
+        speed = faster > wheelCruise ? wheelCruise : faster;
+    }
+
+    // Moves asked for less than creep speed stay at their own speed
+    int16_t creep = wheelCruise < SPEED_CREEP_Q8 ? wheelCruise : SPEED_CREEP_Q8;
+    return speed < creep ? creep : speed;
+}
+
+// Closed-loop speed control, from the systick ISR every SPEED_PERIOD_MS.
+// Each wheel gets the open-loop PWM for the profiled speed plus its PID
+// correction, so both turn at the same measured rate and moves run
+// straight without per-wheel trims.
+void wheelSpeedTick() {
+    if (wheelTarget == 0) {
+        return;
+    }
+
+    // Stop right on target, however long the tasks take to notice
+    if (*moveProgress >= moveGoal) {
+        stop();
+        return;
+    }
+
+    int16_t target = profileSpeed(wheelTarget);
+    wheelTarget = target;
+
+    int16_t feedForward = ((int32_t)target * SPEED_FF_Q16) >> 16;
+
+    driveWheels(
+        feedForward + pidStep(&leftPid, target - leftVelocity.speed),
+        feedForward + pidStep(&rightPid, target - rightVelocity.speed));
+}
+
+// Systick handler, every SPEED_PERIOD_MS: dead reckoning, wheel speeds,
+// then speed control. At WHEEL_MAX_TICKS_PER_S a wheel turns far less than
+// the 127 ticks a period poseUpdate() takes.
+void controlTick() {
+    uint8_t leftNow = leftTravel;
+    uint8_t rightNow = rightTravel;
+    poseUpdate((int8_t)(leftNow - lastLeftTravel),
+               (int8_t)(rightNow - lastRightTravel));
+    lastLeftTravel = leftNow;
+    lastRightTravel = rightNow;
+
+    uint32_t now = hrClockNow();
+    velocityUpdate(&leftVelocity, leftEdges, leftEdgeTime, now);
+    velocityUpdate(&rightVelocity, rightEdges, rightEdgeTime, now);
+
+    wheelSpeedTick();
+}
+
+// Start both wheels, in the sense "dir" says, and hand them to
+// wheelSpeedTick(). They ramp up to "speed" percent and brake so that
+// "*progress" reaches "goal" at creep speed.
+void startWheels(float speed,
+                 volatile unsigned long* progress,
+                 unsigned long goal) {
+    int16_t cruise = (int32_t)pwmVal(speed) * SPEED_MAX_Q8 / 255;
+    if (cruise == 0) {
+        wheelTarget = 0;
+        driveWheels(0, 0);
+        return;
+    }
+
+    // Start off at creep speed, or less if that is all we were asked for
+    int16_t start = cruise < SPEED_CREEP_Q8 ? cruise : SPEED_CREEP_Q8;
+
+    uint8_t state = halIrqSave();
+    halPwmPower(1);  // Left motor PWM, see stop()
+    pidReset(&leftPid);
+    pidReset(&rightPid);
+    moveProgress = progress;
+    moveGoal = goal;
+    wheelCruise = cruise;
+    wheelTarget = start;
+    halIrqRestore(state);
+
+    int16_t val = ((int32_t)start * SPEED_FF_Q16) >> 16;
+    driveWheels(val, val);
+}
+
+// Start both wheel speeds from rest. Needs setupHrClock().
+void setupVelocity() {
+    uint32_t now = hrClockNow();
+    velocityInit(&leftVelocity, SPEED_PERIOD_HR, leftEdges, now);
+    velocityInit(&rightVelocity, SPEED_PERIOD_HR, rightEdges, now);
+}
+
+// Set both wheels' PID gains, Q8
+void setWheelGains(int16_t kp, int16_t ki, int16_t kd) {
+    uint8_t state = halIrqSave();
+    pidSetGains(&leftPid, kp, ki, kd);
+    pidSetGains(&rightPid, kp, ki, kd);
+    halIrqRestore(state);
+}
+
 // Move Alex forward "dist" cm at speed "speed".
 // "speed" is expressed as a percentage. E.g. 50 is
 // move forward at half speed.
@@ -669,23 +896,15 @@ int pwmVal(float speed) {
 void forward(float dist, float speed) {
     // Code tells us how far to move
     if (dist > 0) {
-        deltaDist = dist;
+        deltaDist = cmToTicks((unsigned long)dist);
     } else {
         deltaDist = 9999999;
     }
 
-    newDist = forwardDist + deltaDist;
+    newDist = readTicks(&leftForwardTicks) + deltaDist;
 
     dir = FORWARD;
-    int val = pwmVal(speed);
-
-    // LF = Left forward pin, LR = Left reverse pin
-    // RF = Right forward pin, RR = Right reverse pin
-    // This will be replaced later with bare-metal code.
-    pwmWrite(LF, val);
-    pwmWrite(RF, val - 5);
-    pwmWrite(LR, 0);
-    pwmWrite(RR, 0);
+    startWheels(speed, &leftForwardTicks, newDist);
 }
 
 // Reverse Alex "dist" cm at speed "speed".
@@ -696,37 +915,28 @@ void forward(float dist, float speed) {
 void reverse(float dist, float speed) {
     // Code tells us how far to move
     if (dist > 0) {
-        deltaDist = dist;
+        deltaDist = cmToTicks((unsigned long)dist);
     } else {
         deltaDist = 9999999;
     }
 
-    newDist = reverseDist + deltaDist;
+    newDist = readTicks(&leftReverseTicks) + deltaDist;
 
     dir = BACKWARD;
-
-    int val = pwmVal(speed);
-
-    // LF = Left forward pin, LR = Left reverse pin
-    // RF = Right forward pin, RR = Right reverse pin
-    // This will be replaced later with bare-metal code.
-    pwmWrite(LR, val);
-    pwmWrite(RR, val - 5);
-    pwmWrite(LF, 0);
-    pwmWrite(RF, 0);
+    startWheels(speed, &leftReverseTicks, newDist);
 }
 
 // New function to estimate number of wheel leftTicks needed to turn an angle
-unsigned long computeDeltaTicks(float ang) {
+unsigned long computeDeltaTicks(unsigned long ang) {
     // We will assume that angular distance  moved == linear distance moved in
     // one wheels revolution.This is (probably) incorrect but simplifes
     // calculation. Number of wheel revs to make one full 360 turn is
-    // alexCirc/WHEEL_CIRC This is for 360. For ang degrees it will be(ang
-    // *alexCirc)/(360 * WHEEL_CIRC). To convert to ticks, we multiply by
-    // COUNTS_PER_REV.
+    // turnCirc/wheelCirc This is for 360. For ang degrees it will be(ang
+    // *turnCirc)/(360 * wheelCirc). To convert to ticks, we multiply by
+    // COUNTS_PER_REV. That factor is precomputed in turnTicksPerDegQ16.
 
     unsigned long ticks =
-        (unsigned long)((ang * alexCirc * COUNTS_PER_REV) / (360 * WHEEL_CIRC));
+        (ang * turnTicksPerDegQ16 + 0x8000UL) >> 16;
 
     return ticks;
 }
@@ -737,22 +947,17 @@ unsigned long computeDeltaTicks(float ang) {
 // Specifying an angle of 0 degrees will cause Alex to
 // turn left indefinitely.
 void left(float ang, float speed) {
-    int val = pwmVal(speed);
-
     dir = LEFT;
 
     if (ang == 0) {
         deltaTicks = 99999999;
     } else {
-        deltaTicks = computeDeltaTicks(ang);
+        deltaTicks = computeDeltaTicks((unsigned long)ang);
     }
 
-    targetTicks = leftReverseTicksTurns + deltaTicks;
+    targetTicks = readTicks(&leftReverseTicksTurns) + deltaTicks;
 
-    pwmWrite(LR, val);
-    pwmWrite(RF, val - 5);
-    pwmWrite(LF, 0);
-    pwmWrite(RR, 0);
+    startWheels(speed, &leftReverseTicksTurns, targetTicks);
 }
 
 // Turn Alex right "ang" degrees at speed "speed".
@@ -761,32 +966,35 @@ void left(float ang, float speed) {
 // Specifying an angle of 0 degrees will cause Alex to
 // turn right indefinitely.
 void right(float ang, float speed) {
-    int val = pwmVal(speed);
-
     dir = RIGHT;
 
     if (ang == 0) {
         deltaTicks = 99999999;
     } else {
-        deltaTicks = computeDeltaTicks(ang);
+        deltaTicks = computeDeltaTicks((unsigned long)ang);
     }
 
-    targetTicks = rightReverseTicksTurns + deltaTicks;
+    targetTicks = readTicks(&rightReverseTicksTurns) + deltaTicks;
 
-    // To turn right we reverse the right wheel and move
-    // the left wheel forward.
-    pwmWrite(RR, val - 7);
-    pwmWrite(LF, val);
-    pwmWrite(LR, 0);
-    pwmWrite(RF, 0);
+    startWheels(speed, &rightReverseTicksTurns, targetTicks);
 }
 
 // Stop Alex.
 void stop() {
-    pwmWrite(LF, 0);
-    pwmWrite(LR, 0);
-    pwmWrite(RF, 0);
-    pwmWrite(RR, 0);
+    // Keep the speed controller from driving the wheels again
+    uint8_t state = halIrqSave();
+    wheelTarget = 0;
+    halIrqRestore(state);
+
+    halPwmWrite(LF, 0);
+    halPwmWrite(LR, 0);
+    halPwmWrite(RF, 0);
+    halPwmWrite(RR, 0);
+
+    // Nothing else uses Timer0, so clock it only while the left motor
+    // runs. Both of its pins are disconnected by now; startWheels() powers
+    // it back up before driving them.
+    halPwmPower(0);
 }
 
 // Alex's setup and run codes
@@ -805,21 +1013,85 @@ void clearCounters() {
 
     leftRevs = 0;
     rightRevs = 0;
-    forwardDist = 0;
-    reverseDist = 0;
 }
 
 // Clears one particular counter
 void clearOneCounter(int which) {
+    (void)which;
     clearCounters();
 }
 
+// Start pushing the reports in "mask" every "period" ms
+void subscribeTelemetry(uint32_t mask, uint32_t period, uint32_t fields) {
+    telemetryMask = mask & (TELEMETRY_STATUS | TELEMETRY_TICKS |
+                            TELEMETRY_POSE | TELEMETRY_FIELDS);
+    telemetryFields = fields;
+
+    uint32_t minPeriod = 0;
+    if (telemetryMask & TELEMETRY_STATUS) {
+        minPeriod += TELEMETRY_MS_PER_REPORT;
+    }
+    if (telemetryMask & TELEMETRY_TICKS) {
+        minPeriod += TELEMETRY_MS_PER_REPORT;
+    }
+    if (telemetryMask & TELEMETRY_POSE) {
+        minPeriod += TELEMETRY_MS_PER_REPORT;
+    }
+    if (telemetryMask & TELEMETRY_FIELDS) {
+        minPeriod += TELEMETRY_MS_PER_REPORT;
+    }
+
+    telemetryPeriod = period < minPeriod ? minPeriod : period;
+    lastTelemetry = sysTickMillis();
+}
+
+void unsubscribeTelemetry() {
+    telemetryMask = 0;
+}
+
+// Push the subscribed reports once their period has elapsed
+void pushTelemetry() {
+    if (telemetryMask == 0) {
+        return;
+    }
+
+    uint32_t now = sysTickMillis();
+    if (now - lastTelemetry < telemetryPeriod) {
+        return;
+    }
+
+    // Never hold up other tasks waiting for the UART, report once slots free up
+    uint8_t frames = ((telemetryMask & TELEMETRY_STATUS) ? 1 : 0) +
+                     ((telemetryMask & TELEMETRY_TICKS) ? 1 : 0) +
+                     ((telemetryMask & TELEMETRY_POSE) ? 1 : 0) +
+                     ((telemetryMask & TELEMETRY_FIELDS) ? 1 : 0);
+    if (txFreeSlots() < frames) {
+        return;
+    }
+    lastTelemetry = now;
+
+    if (telemetryMask & TELEMETRY_STATUS) {
+        sendStatus();
+    }
+    if (telemetryMask & TELEMETRY_TICKS) {
+        sendTicks();
+    }
+    if (telemetryMask & TELEMETRY_POSE) {
+        sendPose(0);
+    }
+    if (telemetryMask & TELEMETRY_FIELDS) {
+        sendFields(telemetryFields);
+    }
+}
+
 // Intialize Alex's internal states
 void initializeState() {
     clearCounters();
 }
 
 void handleCommand(TPacket* command) {
+    PROFILE_BEGIN(PROFILE_HANDLE_COMMAND);
+
     switch (command->command) {
         // For movement commands, param[0] = distance, param[1] = speed.
         case COMMAND_FORWARD:
@@ -843,91 +1115,108 @@ void handleCommand(TPacket* command) {
             break;
 
         case COMMAND_STOP:
-            sendOK();
             stop();
+            sendOK();
             break;
 
+        // Commands that return data answer with the data alone
         case COMMAND_GET_STATS:
-            sendOK();
             sendStatus();
             break;
 
+        // param[0] = TStatusField mask
+        case COMMAND_GET_FIELDS:
+            sendFields(command->params[0]);
+            break;
+
         case COMMAND_CLEAR_STATS:
             sendOK();
             clearOneCounter(command->params[0]);
             break;
 
-        default:
-            sendBadCommand();
-    }
-}
+        // param[0] = TTelemetryType mask, param[1] = period in ms,
+        // param[2] = TStatusField mask
+        case COMMAND_SUBSCRIBE:
+            sendOK();
+            subscribeTelemetry(command->params[0], command->params[1],
+                               command->params[2]);
+            break;
 
-void waitForHello() {
-    int exit = 0;
+        case COMMAND_UNSUBSCRIBE:
+            sendOK();
+            unsubscribeTelemetry();
+            break;
 
-    while (!exit) {
-        TPacket hello;
-        TResult result;
+        // param[0..2] = kp, ki, kd in 1/256ths
+        case COMMAND_SET_PID:
+            if (validParam(PARAM_SPEED_KP, command->params[0]) &&
+                validParam(PARAM_SPEED_KI, command->params[1]) &&
+                validParam(PARAM_SPEED_KD, command->params[2])) {
+                sendOK();
+                setParam(PARAM_SPEED_KP, command->params[0]);
+                setParam(PARAM_SPEED_KI, command->params[1]);
+                setParam(PARAM_SPEED_KD, command->params[2]);
+            } else {
+                sendBadParam();
+            }
+            break;
 
-        do {
-            result = readPacket(&hello);
-        } while (result == PACKET_INCOMPLETE);
+        case COMMAND_GET_PARAMS:
+            sendParams();
+            break;
 
-        if (result == PACKET_OK) {
-            if (hello.packetType == PACKET_TYPE_HELLO) {
+        // param[0] = TParam, param[1] = value
+        case COMMAND_SET_PARAM:
+            if (validParam(command->params[0], command->params[1])) {
                 sendOK();
-                exit = 1;
+                setParam((TParam)command->params[0], command->params[1]);
             } else {
-                sendBadResponse();
+                sendBadParam();
             }
-        } else if (result == PACKET_BAD) {
-            sendBadPacket();
-        } else if (result == PACKET_CHECKSUM_BAD) {
-            sendBadChecksum();
-        }
-    }  // !exit
-}
+            break;
 
-void setupColourSensor() {
-    DDRD |= 0b10010011;
-    DDRB &= 0b11111110;
-    PORTD |= 0b00000011;
-    /*
-pinMode(S0, OUTPUT);
-pinMode(S1, OUTPUT);
-pinMode(S2, OUTPUT);
-pinMode(S3, OUTPUT);
-pinMode(OUT, INPUT);
+        // param[0] = 1 to go back to the defaults before saving. Holds up
+        // the tasks for up to ~80 ms of EEPROM writes, which moves ride
+        // out: they stop on target from the control tick.
+        case COMMAND_SAVE_PARAMS:
+            sendOK();
+            if (command->params[0] == 1) {
+                defaultParams();
+            }
+            saveParams();
+            break;
 
-digitalWrite(S0, HIGH);
-digitalWrite(S1, HIGH);
-    */
-}
+        // param[0] = 1 to reset the pose once sent
+        case COMMAND_GET_POSE:
+            sendPose(command->params[0] == 1);
+            break;
 
-void setupUltrasonicSensor() {
-    // pinMode(trigPin, OUTPUT);
-    // pinMode(echoPin, INPUT);
-}
+        case COMMAND_GET_TASKS:
+            sendTasks();
+            break;
 
-void setup() {
-    // put your setup code here, to run once:
-    alexDiagonal =
-        sqrt((ALEX_LENGTH * ALEX_LENGTH) + (ALEX_BREADTH * ALEX_BREADTH));
+#ifdef PROFILE
+        // param[0] = 1 to clear the profile once sent
+        case COMMAND_GET_PROFILE:
+            sendProfile(command->params[0] == 1);
+            break;
+#endif
 
-    alexCirc = M_PI * alexDiagonal;
+        default:
+            sendBadCommand();
+    }
 
-    cli();
-    setupEINT();
-    setupSerial();
-    startSerial();
-    setupMotors();
-    startMotors();
-    enablePullups();
-    initializeState();
-    setupColourSensor();
-    setupUltrasonicSensor();
-    // setupPowerSaving();
-    sei();
+    PROFILE_END(PROFILE_HANDLE_COMMAND);
+}
+
+// Called from the ultrasonic echo ISR after every near ping, so an
+// obstacle stops a forward move without waiting for loop() to notice.
+void obstacleNear() {
+    if (dir == FORWARD && deltaDist > 0) {
+        deltaDist = 0;
+        newDist = 0;
+        stop();
+    }
 }
 
 void handlePacket(TPacket* packet) {
@@ -945,37 +1234,95 @@ void handlePacket(TPacket* packet) {
         case PACKET_TYPE_MESSAGE:
             break;
 
+        // Start the flow control count again, see RECV_WINDOW
         case PACKET_TYPE_HELLO:
+            rxTaken = 0;
+            sendOK();
             break;
     }
 }
 
-void loop() {
-    // Code to run repeatedly:
-    PORTD |= 0b11;
+// Finish an emergency stop the receive ISR started: it overrides every
+// command that came before it, so drop those, and answer it
+void acknowledgeStop() {
+    uint8_t state = halIrqSave();
+    uint8_t head = stopHead;
+    char seq = stopSeq;
+    stopPending = 0;
+    halIrqRestore(state);
+
+    // Skip to just past the token, unless the parser already took bytes
+    // beyond it, in which case only the frame it was assembling goes
+    uint8_t before = (uint8_t)(head - recvbuf.tail) & (RECV_BUF_LEN - 1);
+    if (before <= ringCount(&recvbuf)) {
+        ringSkip(&recvbuf, before);
+        rxTaken += before;
+    }
+    recvFrame.count = 0;
+
+    // The ISR only cut the PWM. No move is left to supervise either.
+    stop();
+    dir = STOP;
+    deltaDist = 0;
+    newDist = 0;
+    deltaTicks = 0;
+    targetTicks = 0;
+
+    replySeq = seq;
+    sendOK();
+    replySeq = 0;
+}
+
+// Task: handle the next command from the Pi, if one has arrived
+void processPackets() {
+    TPacket* recvPacket;  // Command from the Pi, in place in recvFrame
 
-    TPacket recvPacket;  // This holds commands from the Pi
+    // Every frame is answered, so only take one on once its reply has a
+    // slot to go in; otherwise it waits in recvbuf until the next pass,
+    // rather than the task blocking in txAcquire()
+    if (txFreeSlots() == 0) {
+        return;
+    }
+
+    if (stopPending) {
+        acknowledgeStop();
+        return;
+    }
 
     TResult result = readPacket(&recvPacket);
 
+    // A frame that ended before a stop token does not get to run after it
+    if (stopPending) {
+        acknowledgeStop();
+        return;
+    }
+
     if (result == PACKET_OK) {
-        handlePacket(&recvPacket);
+        rxFrames++;
+        replySeq = recvPacket->seq;
+        handlePacket(recvPacket);
+        replySeq = 0;
     } else if (result == PACKET_BAD) {
+        rxBadPackets++;
         sendBadPacket();
     } else if (result == PACKET_CHECKSUM_BAD) {
+        rxBadChecksums++;
         sendBadChecksum();
     }
+}
 
+// Task: clear up after a move wheelSpeedTick() stopped on its target, or
+// stop one that covered its distance or angle some other way
+void superviseMotion() {
     if (deltaDist > 0) {
         if (dir == FORWARD) {
-            if (forwardDist >= newDist || near == 1) {
+            if (readTicks(&leftForwardTicks) >= newDist || ultrasonicNear()) {
                 deltaDist = 0;
                 newDist = 0;
-                int temp = calculateUltrasonic();  // this is wrong
                 stop();
             }
         } else if (dir == BACKWARD) {
-            if (reverseDist >= newDist) {
+            if (readTicks(&leftReverseTicks) >= newDist) {
                 deltaDist = 0;
                 newDist = 0;
                 stop();
@@ -984,19 +1331,18 @@ void loop() {
             deltaDist = 0;
             newDist = 0;
             stop();
-            // putArduinoToIdle();
         }
     }
 
     if (deltaTicks > 0) {
         if (dir == LEFT) {
-            if (leftReverseTicksTurns >= targetTicks) {
+            if (readTicks(&leftReverseTicksTurns) >= targetTicks) {
                 deltaTicks = 0;
                 targetTicks = 0;
                 stop();
             }
         } else if (dir == RIGHT) {
-            if (rightReverseTicksTurns >= targetTicks) {
+            if (readTicks(&rightReverseTicksTurns) >= targetTicks) {
                 deltaTicks = 0;
                 targetTicks = 0;
                 stop();
@@ -1005,16 +1351,85 @@ void loop() {
             deltaTicks = 0;
             targetTicks = 0;
             stop();
-            // putArduinoToIdle();
         }
     }
 }
 
+// Work out again whatever depends on "param", see params.h
+void applyParam(TParam param) {
+    switch (param) {
+        case PARAM_WHEEL_CIRC:
+        case PARAM_TURN_DIAMETER:
+            wheelCircCenti = getParam(PARAM_WHEEL_CIRC);
+            // Both in 0.1 mm. Float, but only when they change.
+            turnTicksPerDegQ16 =
+                (unsigned long)(M_PI * getParam(PARAM_TURN_DIAMETER) *
+                                COUNTS_PER_REV * 65536.0 /
+                                (360.0 * wheelCircCenti));
+            setPoseScale(turnTicksPerDegQ16);
+            break;
+
+        case PARAM_NEAR_CM:
+            setUltrasonicNear(getParam(PARAM_NEAR_CM));
+            break;
+
+        case PARAM_SPEED_KP:
+        case PARAM_SPEED_KI:
+        case PARAM_SPEED_KD:
+            setWheelGains(getParam(PARAM_SPEED_KP), getParam(PARAM_SPEED_KI),
+                          getParam(PARAM_SPEED_KD));
+            break;
+
+        default:
+            // The colour thresholds are read where they are used
+            break;
+    }
+}
+
+// Register everything loop() runs. Call after the modules are set up.
+void setupTasks() {
+    taskIds[TASK_MOTION] = addTask(superviseMotion, 0, PRIORITY_MOTION);
+    taskIds[TASK_PACKETS] = addTask(processPackets, 0, PRIORITY_PACKETS);
+    taskIds[TASK_COLOUR] =
+        addTask(serviceColourSampler, COLOUR_TASK_MS, PRIORITY_COLOUR);
+    taskIds[TASK_TELEMETRY] =
+        addTask(pushTelemetry, TELEMETRY_TASK_MS, PRIORITY_TELEMETRY);
+}
+
+void setup() {
+    // put your setup code here, to run once:
+    halSetup();
+    setupEINT();
+    setupSysTick();
+    setupParams(applyParam);
+    setupPose(turnTicksPerDegQ16);
+    setSysTickHandler(controlTick, SPEED_PERIOD_MS);
+    setupHrClock();
+    setupVelocity();
+#ifdef PROFILE
+    setupProfiler();
+#endif
+    setupSerial();
+    setupMotors();
+    enablePullups();
+    initializeState();
+    setupColourSampler();
+    setupUltrasonic(obstacleNear);
+    setupPowerSaving();
+    setupTasks();
+    stop();
+    halIrqEnable();
+}
+
+void loop() {
+    runTasks();
+    waitForEvent();
+}
+
 #ifndef ARDUINO
 int main() {
     setup();
     while (1) {
-        // writeSerial("please", 7);
         loop();
     }
 }
@@ -5,75 +5,159 @@
  *  Author: dcstanc
  */
 
-
 #ifndef BUFFER_H_
 #define BUFFER_H_
 
-typedef struct tb
-{
-	// The actual buffer
-	unsigned char *buffer;
-
-	// Front and back pointers
-	unsigned int front, back;
-
-	// Our buffer size
-	unsigned int size;
-
-	// Number of characters in buffer
-	unsigned int count;
+#include <stdint.h>
 
-	// This is for atomicity control
-	unsigned char csreg;
-
-} TBuffer;
-
-typedef enum
-{
-	BUFFER_OK,
-	BUFFER_FULL,
-	BUFFER_EMPTY,
-	BUFFER_INVALID
+typedef enum {
+    BUFFER_OK,
+    BUFFER_FULL,
+    BUFFER_EMPTY,
+    BUFFER_INVALID
 } TBufferResult;
 
-// Intialize the buffer. We must call this before using writeBuffer or readBuffer.
-// PRE:
-//		Buffer to use is specified in "buffer", size of buffer in characters is specified in "size"
-// POST:
-//		Buffer is initialized to accept up to "size" characters.
-void initBuffer(volatile TBuffer *buffer, unsigned int size);
-
-// Write to the buffer.
-// PRE:
-//		Buffer specified in "buffer" argument must be initialized using initBuffer. "data" is character to
-//		write to buffer.
-// POST:
-//		"data" is written to "buffer" and writeBuffer returns BUFFER_OK if space is available.
-//		"data" is discarded and writeBuffer returns BUFFER_FULL if space is not available.
-//		"data" is discarded and writeBuffer returns BUFFER_INVALID if "buffer" was not initialized using initBuffer.
-
-TBufferResult writeBuffer(volatile TBuffer *buffer, unsigned char data);
-
-// Read from the buffer.
-// PRE:
-//		Buffer specified in "buffer" argument must be initialized using initBuffer. "data" is a pointer
-//		to a variable of type unsigned char.
-// POST:
-//		Variable pointed to by "data" contains character read from head of the queue, and readBuffer returns
-//		BUFFER_OK if data is available for reading.
-//		Variable pointed to by "data" is unmodified, and readBuffer returns BUFFER_EMTPY if no data is available.
-//		Variable pointed to by "data" is unmodified, and readBuffer returns BUFFER_INVALID if "buffer" was
-//		not initialized using initBuffer.
-
-TBufferResult readBuffer(volatile TBuffer *buffer, unsigned char *data);
-
-// Frees buffer
-// PRE:
-//		"buffer" points to buffer to free
-// POST:
-//		"buffer" is deallocated.
-
-void freeBuffer(volatile TBuffer *buffer);
-
-int dataAvailable(volatile TBuffer *buffer);
+// Stop the compiler moving buffer contents across an index update
+#define BUFFER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// Single-producer/single-consumer circular buffer of SIZE bytes, where SIZE
+// is a power of two no larger than 256. It holds up to SIZE - 1 bytes.
+//
+// Only the producer writes "head" and only the consumer writes "tail". Both
+// are single bytes, which the AVR loads and stores in one instruction, so
+// one side can be an ISR without either side disabling interrupts. Indices
+// wrap with a mask, never a division.
+//
+// Storage is static, e.g. "TRingBuffer<256> recvbuf;" at file scope starts
+// out empty.
+template <uint16_t SIZE>
+struct TRingBuffer {
+    static_assert(SIZE >= 2 && SIZE <= 256 && (SIZE & (SIZE - 1)) == 0,
+                  "ring size must be a power of two from 2 to 256");
+
+    unsigned char data[SIZE];
+
+    // Next byte to write, producer only
+    volatile uint8_t head;
+
+    // Next byte to read, consumer only
+    volatile uint8_t tail;
+};
+
+// Bytes waiting to be read. Exact for the consumer, a lower bound for the
+// producer.
+template <uint16_t SIZE>
+inline uint16_t ringCount(const TRingBuffer<SIZE>* ring) {
+    return (uint8_t)(ring->head - ring->tail) & (SIZE - 1);
+}
+
+// Bytes that can be written. Exact for the producer, a lower bound for the
+// consumer.
+template <uint16_t SIZE>
+inline uint16_t ringSpace(const TRingBuffer<SIZE>* ring) {
+    return SIZE - 1 - ringCount(ring);
+}
+
+// Producer: append one byte. Returns BUFFER_FULL, dropping "data", if there
+// is no room.
+template <uint16_t SIZE>
+inline TBufferResult ringPut(TRingBuffer<SIZE>* ring, unsigned char data) {
+    uint8_t head = ring->head;
+    uint8_t next = (head + 1) & (SIZE - 1);
+
+    if (next == ring->tail) {
+        return BUFFER_FULL;
+    }
+
+    ring->data[head] = data;
+    BUFFER_BARRIER();
+    ring->head = next;
+
+    return BUFFER_OK;
+}
+
+// Consumer: take one byte. Returns BUFFER_EMPTY, leaving "data" untouched,
+// if there is none.
+template <uint16_t SIZE>
+inline TBufferResult ringGet(TRingBuffer<SIZE>* ring, unsigned char* data) {
+    uint8_t tail = ring->tail;
+
+    if (tail == ring->head) {
+        return BUFFER_EMPTY;
+    }
+
+    *data = ring->data[tail];
+    BUFFER_BARRIER();
+    ring->tail = (tail + 1) & (SIZE - 1);
+
+    return BUFFER_OK;
+}
+
+// Producer: append up to "len" bytes from "src" and publish them all at
+// once. Returns how many fit.
+template <uint16_t SIZE>
+inline uint16_t ringWrite(TRingBuffer<SIZE>* ring,
+                          const unsigned char* src,
+                          uint16_t len) {
+    uint16_t space = ringSpace(ring);
+    if (len > space) {
+        len = space;
+    }
+
+    uint8_t head = ring->head;
+    for (uint16_t i = 0; i < len; i++) {
+        ring->data[head] = src[i];
+        head = (head + 1) & (SIZE - 1);
+    }
+
+    BUFFER_BARRIER();
+    ring->head = head;
+
+    return len;
+}
+
+// Consumer: take up to "len" bytes into "dst". Returns how many were read.
+template <uint16_t SIZE>
+inline uint16_t ringRead(TRingBuffer<SIZE>* ring,
+                         unsigned char* dst,
+                         uint16_t len) {
+    uint16_t count = ringCount(ring);
+    if (len > count) {
+        len = count;
+    }
+
+    uint8_t tail = ring->tail;
+    for (uint16_t i = 0; i < len; i++) {
+        dst[i] = ring->data[tail];
+        tail = (tail + 1) & (SIZE - 1);
+    }
+
+    BUFFER_BARRIER();
+    ring->tail = tail;
+
+    return len;
+}
+
+// Consumer: point "span" at the unread bytes in place, without copying.
+// Returns how many are contiguous from there, which stops short of
+// ringCount() when the data wraps past the end of the storage. Call
+// ringSkip() once done with them.
+template <uint16_t SIZE>
+inline uint16_t ringPeek(const TRingBuffer<SIZE>* ring,
+                         const unsigned char** span) {
+    uint8_t tail = ring->tail;
+    uint16_t count = ringCount(ring);
+    uint16_t toEnd = SIZE - tail;
+
+    *span = &ring->data[tail];
+    return count < toEnd ? count : toEnd;
+}
+
+// Consumer: release "len" bytes, at most ringCount(), back to the producer.
+template <uint16_t SIZE>
+inline void ringSkip(TRingBuffer<SIZE>* ring, uint16_t len) {
+    BUFFER_BARRIER();
+    ring->tail = (ring->tail + len) & (SIZE - 1);
+}
+
 #endif /* BUFFER_H_ */
@@ -0,0 +1,141 @@
+#include "colour.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include "hrclock.h"
+#include "systick.h"
+
+// Whole periods timed per filter. Averaging a few smooths out jitter, and
+// the capture ISR (~3 us) is far shorter than any period we expect.
+#define COLOUR_PERIODS 4
+
+// Start a new round this often, and abandon one that takes longer than
+// COLOUR_TIMEOUT_MS (no light, or no sensor plugged in).
+#define COLOUR_INTERVAL_MS 50
+#define COLOUR_TIMEOUT_MS 40
+
+// S2 is PD4 and S3 is PD7
+#define COLOUR_FILTER_MASK 0b10010000
+
+typedef enum {
+    CHANNEL_RED = 0,
+    CHANNEL_BLUE = 1,
+    CHANNEL_GREEN = 2,
+    CHANNEL_COUNT = 3
+} TColourChannel;
+
+// S2/S3 levels per channel: LOW/LOW is red, LOW/HIGH is blue and HIGH/HIGH
+// is green
+static const uint8_t _filters[CHANNEL_COUNT] = {0b00000000, 0b10000000,
+                                                0b10010000};
+
+// State of the round in progress, owned by the capture ISR while _busy
+static volatile uint8_t _busy = 0;
+static uint8_t _channel;
+static uint8_t _edges;
+static uint32_t _start;
+static uint16_t _halfPeriods[CHANNEL_COUNT];
+static uint32_t _roundStart;
+
+// Last complete round
+static volatile TColourSample _latest;
+static volatile uint8_t _haveSample = 0;
+
+static void selectChannel(uint8_t channel) {
+    _channel = channel;
+    _edges = 0;
+    PORTD = (PORTD & ~COLOUR_FILTER_MASK) | _filters[channel];
+
+    // Forget any edge captured under the previous filter
+    TIFR1 = _BV(ICF1);
+}
+
+static void startRound(uint32_t now) {
+    uint8_t sreg = SREG;
+    cli();
+    selectChannel(CHANNEL_RED);
+    _busy = 1;
+    TIMSK1 |= _BV(ICIE1);
+    SREG = sreg;
+
+    _roundStart = now;
+}
+
+void setupColourSampler() {
+    // S0, S1, S2, S3 as outputs, OUT (PB0) as input
+    DDRD |= 0b10010011;
+    DDRB &= 0b11111110;
+
+    // S0/S1 HIGH for 100% output frequency scaling
+    PORTD |= 0b00000011;
+
+    // Capture rising edges, with the noise canceller on. setupHrClock()
+    // has already set the rest of TCCR1B.
+    TCCR1B |= _BV(ICNC1) | _BV(ICES1);
+}
+
+void serviceColourSampler() {
+    uint32_t now = sysTickMillis();
+
+    if (_busy) {
+        if (now - _roundStart >= COLOUR_TIMEOUT_MS) {
+            // Keep the last good sample and try again next interval
+            uint8_t sreg = SREG;
+            cli();
+            TIMSK1 &= ~_BV(ICIE1);
+            _busy = 0;
+            SREG = sreg;
+        }
+        return;
+    }
+
+    if (now - _roundStart >= COLOUR_INTERVAL_MS) {
+        startRound(now);
+    }
+}
+
+int readColourSample(TColourSample* sample) {
+    uint8_t sreg = SREG;
+    cli();
+    int have = _haveSample;
+    if (have) {
+        sample->red = _latest.red;
+        sample->green = _latest.green;
+        sample->blue = _latest.blue;
+    }
+    SREG = sreg;
+
+    return have;
+}
+
+ISR(TIMER1_CAPT_vect) {
+    uint32_t now = hrClockExtend(ICR1L);
+
+    if (_edges == 0) {
+        _start = now;
+        _edges = 1;
+        return;
+    }
+
+    if (_edges < COLOUR_PERIODS) {
+        _edges++;
+        return;
+    }
+
+    // COLOUR_PERIODS whole periods have passed since _start
+    uint32_t halfPeriod =
+        (now - _start) / (COLOUR_PERIODS * HRCLOCK_TICKS_PER_US * 2);
+    _halfPeriods[_channel] = halfPeriod > 0xFFFF ? 0xFFFF : halfPeriod;
+
+    if (_channel + 1 < CHANNEL_COUNT) {
+        selectChannel(_channel + 1);
+        return;
+    }
+
+    _latest.red = _halfPeriods[CHANNEL_RED];
+    _latest.green = _halfPeriods[CHANNEL_GREEN];
+    _latest.blue = _halfPeriods[CHANNEL_BLUE];
+    _haveSample = 1;
+
+    TIMSK1 &= ~_BV(ICIE1);
+    _busy = 0;
+}
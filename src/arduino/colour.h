@@ -0,0 +1,32 @@
+#ifndef COLOUR_H_
+#define COLOUR_H_
+
+#include <stdint.h>
+
+// Background TCS3200/230 colour sampler.
+// OUT is on PB0 (ICP1), so Timer1's input capture timestamps its edges
+// while the CPU gets on with other work. The sampler steps through the
+// red, blue and green filters (S2/S3) by itself and publishes a complete
+// sample after each round.
+
+// One complete reading. Each channel is the sensor's half period in us,
+// the same unit the old blocking pulseWidth() reads returned, so the
+// colour thresholds still apply. Smaller means more of that colour.
+typedef struct {
+    uint16_t red;
+    uint16_t green;
+    uint16_t blue;
+} TColourSample;
+
+// Set up the sensor pins. Needs setupHrClock() and setupSysTick().
+void setupColourSampler();
+
+// Start rounds as they fall due and abandon ones the sensor never
+// finishes. Call often, e.g. from loop(); it returns quickly.
+void serviceColourSampler();
+
+// Copy the latest complete sample into "sample". Returns 0, leaving
+// "sample" untouched, if no round has completed yet.
+int readColourSample(TColourSample* sample);
+
+#endif /* COLOUR_H_ */
@@ -0,0 +1,115 @@
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stdint.h>
+
+// Hardware abstraction layer.
+// Everything alex.cpp, systick, txqueue and the profiler need from the MCU:
+// interrupt control, GPIO, motor PWM, the UART, the 1 ms timer, the encoder
+// interrupts, EEPROM and delays. hal_avr.cpp implements it on the ATmega328P;
+// ../host/hal_host.cpp implements it on Linux, with the UART on a PTY and
+// interrupts simulated by a thread, so the same firmware logic builds and
+// runs on a workstation.
+//
+// Interrupts are delivered to handlers the application defines (the
+// halXxxHandler() functions below). They are plain functions rather than
+// pointers so the AVR ISRs call, or inline, them directly.
+//
+// The sensor modules (hrclock, colour, ultrasonic) sit on dedicated timer
+// and capture hardware and keep their own interfaces; the host build has
+// stand-ins for them.
+
+// Interrupts
+
+// Bring up whatever the HAL itself needs. Call first thing in setup(),
+// before any other hal function. Interrupts are disabled on return.
+void halSetup();
+
+// Disable interrupts and return whether they were enabled, for a later
+// halIrqRestore(). Nests, like saving and restoring SREG.
+uint8_t halIrqSave();
+void halIrqRestore(uint8_t state);
+
+void halIrqDisable();
+void halIrqEnable();
+
+// Call with interrupts disabled. Enables them and sleeps until the next
+// interrupt has been handled, without missing one that is already
+// pending. Returns with interrupts enabled.
+void halSleep();
+
+// Switch off what Alex never uses (watchdog, ADC, analog comparator, TWI,
+// SPI) and make halSleep() a light sleep that every interrupt source
+// still wakes up from.
+void halPowerSaving();
+
+// GPIO, by Arduino Uno pin number (0 to 13)
+
+void halPinOutput(uint8_t pin);
+void halPinInputPullup(uint8_t pin);
+void halPinWrite(uint8_t pin, uint8_t high);
+
+// Motor PWM on pins 5 and 6 (Timer0) and 9 and 10 (Timer1), ~7.8 kHz
+
+// Make the PWM pins outputs with a 0 duty cycle
+void halPwmSetup();
+
+// Duty cycle out of 255 on "pin". 0 or less drives the pin low
+// continuously, more than 255 counts as 255. Safe from interrupts.
+void halPwmWrite(uint8_t pin, int val);
+
+// Clock Timer0, which drives pins 5 and 6, or not. Only turn it off with
+// both pins at 0.
+void halPwmPower(uint8_t on);
+
+// UART, 8N1
+
+// Set up the UART at "baud" and enable receive interrupts
+void halUartSetup(uint32_t baud);
+
+// Start calling halUartTxHandler() whenever the UART can take a byte, until
+// it returns a negative value
+void halUartStartTx();
+
+// Application: one received byte, from interrupt context
+void halUartRxHandler(uint8_t data);
+
+// Application: the next byte to send, or -1 if there is none, from
+// interrupt context
+int16_t halUartTxHandler();
+
+// 1 ms timer
+
+// Call halTickHandler() every millisecond. On the AVR this is Timer2 in
+// CTC mode, which the ultrasonic trigger shares.
+void halTickSetup();
+
+// Application: one millisecond has passed, from interrupt context
+void halTickHandler();
+
+// External interrupts
+
+// Falling edges on pins 2 (INT0) and 3 (INT1), i.e. the left and right
+// wheel encoders
+void halExtIntSetup();
+
+// Application: one edge on INT0 or INT1, from interrupt context
+void halExtInt0Handler();
+void halExtInt1Handler();
+
+// EEPROM, 1 KB
+
+// Copy "len" bytes from EEPROM address "addr" on
+void halEepromRead(uint16_t addr, void* data, uint16_t len);
+
+// Store "len" bytes at EEPROM address "addr" on. Only bytes that differ are
+// written, each busy-waiting ~3.4 ms on the AVR with interrupts still
+// running, so keep this out of anything time critical.
+void halEepromWrite(uint16_t addr, const void* data, uint16_t len);
+
+// Delays
+
+// Busy-wait "ms" milliseconds. Interrupts still run.
+void halDelayMs(uint16_t ms);
+
+#endif /* HAL_H_ */
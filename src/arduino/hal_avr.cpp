@@ -0,0 +1,323 @@
+#if !(defined(__AVR) || defined(AVR) || defined(__AVR_ATmega328P__))
+#define __AVR_ATmega328P__
+#endif
+
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <util/delay.h>
+#include "hal.h"
+
+// use L and H for 16 bit regs
+#define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
+#define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
+
+// 16 MHz / 64 = 250 kHz, so 250 counts make up one millisecond
+#define TICK_PRESCALER_BITS (_BV(CS22))
+#define TICK_COUNTS_PER_MS 250
+
+// Arduino pins 0 to 7 are PD0 to PD7, 8 to 13 are PB0 to PB5
+static volatile uint8_t* pinPort(uint8_t pin) {
+    return pin < 8 ? &PORTD : &PORTB;
+}
+
+static volatile uint8_t* pinDdr(uint8_t pin) {
+    return pin < 8 ? &DDRD : &DDRB;
+}
+
+static uint8_t pinMask(uint8_t pin) {
+    return _BV(pin < 8 ? pin : pin - 8);
+}
+
+void halSetup() {
+    cli();
+}
+
+uint8_t halIrqSave() {
+    uint8_t sreg = SREG;
+    cli();
+
+    return sreg & _BV(SREG_I);
+}
+
+void halIrqRestore(uint8_t state) {
+    if (state) {
+        sei();
+    }
+}
+
+void halIrqDisable() {
+    cli();
+}
+
+void halIrqEnable() {
+    sei();
+}
+
+void halSleep() {
+    sleep_enable();
+
+    // The instruction after sei() always runs before any interrupt, so one
+    // that lands here still wakes us instead of being missed
+    sei();
+    sleep_cpu();
+    sleep_disable();
+}
+
+static void watchdogOff() {
+    // Interrupts must stay off through the timed sequence
+    uint8_t state = halIrqSave();
+
+    // Clear WDRF in MCUSR
+    MCUSR &= ~(1 << WDRF);
+
+    // Write logical one to WDCE and WDE
+    // Keep old prescaler setting to prevent unintentional time-out
+    WDTCSR |= (1 << WDCE) | (1 << WDE);
+
+    // Turn off WDT
+    WDTCSR = 0x00;
+
+    halIrqRestore(state);
+}
+
+void halPowerSaving() {
+    watchdogOff();
+
+    // Disable the ADC before shutting its clock down, or it keeps drawing
+    // current. The analog comparator runs off the same supply.
+    ADCSRA &= ~_BV(ADEN);
+    ACSR |= _BV(ACD);
+
+    PRR |= _BV(PRTWI) | _BV(PRSPI) | _BV(PRADC);
+
+    // IDLE keeps the clocks to the timers and USART running, so every
+    // interrupt source can still wake us, within a few cycles. Do not set
+    // the Sleep Enable (SE) bit yet.
+    set_sleep_mode(SLEEP_MODE_IDLE);
+}
+
+void halPinOutput(uint8_t pin) {
+    *pinDdr(pin) |= pinMask(pin);
+}
+
+void halPinInputPullup(uint8_t pin) {
+    *pinDdr(pin) &= ~pinMask(pin);
+    *pinPort(pin) |= pinMask(pin);
+}
+
+void halPinWrite(uint8_t pin, uint8_t high) {
+    uint8_t state = halIrqSave();
+
+    if (high) {
+        *pinPort(pin) |= pinMask(pin);
+    } else {
+        *pinPort(pin) &= ~pinMask(pin);
+    }
+
+    halIrqRestore(state);
+}
+
+void halPwmSetup() {
+    /* Our motor set up is:
+       A1IN - Pin 5, PD5, OC0B
+       A2IN - Pin 6, PD6, OC0A
+       B1IN - Pin 9, PB1, OC1A
+       B2IN - Pin 10, PB2, OC1B
+    */
+    DDRB |= 0b110;
+    DDRD |= 0b1100000;
+
+    // clk/8, 7.8 kHz. Timer1's clock is set up by setupHrClock() to the
+    // same rate, since it also keeps time and captures colour edges.
+    cbi(TCCR0B, CS00);
+    sbi(TCCR0B, CS01);
+    cbi(TCCR0B, CS02);
+
+    // initialise counter
+    TCNT0 = 0;
+    OCR0A = 0;
+    OCR0B = 0;
+    OCR1AL = 0;
+    OCR1AH = 0;
+    OCR1BL = 0;
+    OCR1BH = 0;
+
+    // fast PWM, 8 bit, like Timer1: input capture needs a timer that only
+    // counts up, and both wheels should see the same PWM frequency
+    sbi(TCCR0A, WGM00);
+    sbi(TCCR0A, WGM01);
+    cbi(TCCR0B, WGM02);
+
+    // clear on compare, non-inverted. halPwmWrite() sets COMxx1 to connect
+    // each pin once it is given a non-zero duty cycle.
+    cbi(TCCR0A, COM0A0);
+    cbi(TCCR0A, COM0B0);
+    cbi(TCCR1A, COM1A0);
+    cbi(TCCR1A, COM1B0);
+}
+
+void halPwmWrite(uint8_t pin, int val) {
+    volatile uint8_t* timer_comp;
+    volatile uint8_t* timer_ctrl;
+    uint8_t com;
+
+    switch (pin) {
+        case 5:
+            timer_comp = &OCR0B;
+            timer_ctrl = &TCCR0A;
+            com = _BV(COM0B1);
+            break;
+
+        case 6:
+            timer_comp = &OCR0A;
+            timer_ctrl = &TCCR0A;
+            com = _BV(COM0A1);
+            break;
+
+        case 9:
+            timer_comp = &OCR1AL;
+            timer_ctrl = &TCCR1A;
+            com = _BV(COM1A1);
+            break;
+
+        case 10:
+            timer_comp = &OCR1BL;
+            timer_ctrl = &TCCR1A;
+            com = _BV(COM1B1);
+            break;
+
+        default:
+            return;
+    }
+
+    uint8_t state = halIrqSave();
+
+    // Fast PWM still puts out a one count spike at 0, so disconnect the
+    // pin (its PORT bit is low) instead. Speed controller outputs may also
+    // go negative and must not wrap around to near full speed.
+    if (val <= 0) {
+        *timer_ctrl &= ~com;
+        *timer_comp = 0;
+    } else {
+        *timer_comp = val > 255 ? 255 : val;
+        *timer_ctrl |= com;
+    }
+
+    halIrqRestore(state);
+}
+
+void halPwmPower(uint8_t on) {
+    uint8_t state = halIrqSave();
+
+    if (on) {
+        PRR &= ~_BV(PRTIM0);
+    } else {
+        PRR |= _BV(PRTIM0);
+    }
+
+    halIrqRestore(state);
+}
+
+void halUartSetup(uint32_t baud) {
+    // async
+    cbi(UCSR0C, UMSEL00);
+    cbi(UCSR0C, UMSEL01);
+    cbi(UCSR0C, UCPOL0);
+
+    // parity: none
+    cbi(UCSR0C, UPM00);
+    cbi(UCSR0C, UPM01);
+
+    // stop bit: 1
+    cbi(UCSR0C, USBS0);
+
+    // data size: 8
+    sbi(UCSR0C, UCSZ00);
+    sbi(UCSR0C, UCSZ01);
+    cbi(UCSR0B, UCSZ02);
+    cbi(UCSR0B, TXB80);
+
+    uint16_t b = F_CPU / 16 / baud - 1;
+    UBRR0H = (uint8_t)(b >> 8);
+    UBRR0L = (uint8_t)b;
+
+    // single processor, normal transmission speed
+    cbi(UCSR0A, MPCM0);
+    cbi(UCSR0A, U2X0);
+
+    // enable rx and tx
+    sbi(UCSR0B, TXEN0);
+    sbi(UCSR0B, RXEN0);
+
+    // enable interrupts
+    cbi(UCSR0B, TXCIE0);
+    sbi(UCSR0B, RXCIE0);
+    cbi(UCSR0B, UDRIE0);  // data reg empty interrupt
+}
+
+void halUartStartTx() {
+    // The ISR only ever clears this bit, once the handler runs dry, so a
+    // race just leaves it set
+    UCSR0B |= _BV(UDRIE0);
+}
+
+ISR(USART_RX_vect) {
+    halUartRxHandler(UDR0);
+}
+
+ISR(USART_UDRE_vect) {
+    int16_t next = halUartTxHandler();
+
+    if (next < 0) {
+        // Nothing left, halUartStartTx() turns us back on
+        UCSR0B &= ~_BV(UDRIE0);
+    } else {
+        UDR0 = next;
+    }
+}
+
+void halTickSetup() {
+    // CTC mode, TOP = OCR2A
+    TCCR2A = _BV(WGM21);
+    TCCR2B = TICK_PRESCALER_BITS;
+    OCR2A = TICK_COUNTS_PER_MS - 1;
+    TCNT2 = 0;
+
+    // Interrupt on compare match A
+    TIMSK2 |= _BV(OCIE2A);
+}
+
+ISR(TIMER2_COMPA_vect) {
+    halTickHandler();
+}
+
+void halExtIntSetup() {
+    // Configure pins 2 and 3 to be falling edge triggered.
+    // Enable INT0 and INT1 interrupts.
+    EIMSK |= 0b11;
+    EICRA = 0b1010;
+}
+
+ISR(INT0_vect) {
+    halExtInt0Handler();
+}
+
+ISR(INT1_vect) {
+    halExtInt1Handler();
+}
+
+void halEepromRead(uint16_t addr, void* data, uint16_t len) {
+    eeprom_read_block(data, (const void*)(uintptr_t)addr, len);
+}
+
+void halEepromWrite(uint16_t addr, const void* data, uint16_t len) {
+    eeprom_update_block(data, (void*)(uintptr_t)addr, len);
+}
+
+void halDelayMs(uint16_t ms) {
+    while (ms-- > 0) {
+        _delay_ms(1);
+    }
+}
@@ -0,0 +1,39 @@
+#include "hrclock.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+static volatile uint32_t _overflows = 0;
+
+void setupHrClock() {
+    // Fast PWM 8 bit: WGM13:0 = 0101, TOP = 0xFF
+    TCCR1A = _BV(WGM10);
+    TCCR1B = _BV(WGM12) | _BV(CS11);  // clk/8
+    TCNT1 = 0;
+
+    TIMSK1 |= _BV(TOIE1);
+}
+
+uint32_t hrClockExtend(uint8_t count) {
+    uint32_t overflows = _overflows;
+
+    // The counter wrapped after the capture would have read 0xFF; if it
+    // wrapped before, and the ISR has not run yet, count it ourselves.
+    if ((TIFR1 & _BV(TOV1)) && count < 0x80) {
+        overflows++;
+    }
+
+    return (overflows << 8) | count;
+}
+
+uint32_t hrClockNow() {
+    uint8_t sreg = SREG;
+    cli();
+    uint32_t now = hrClockExtend(TCNT1L);
+    SREG = sreg;
+
+    return now;
+}
+
+ISR(TIMER1_OVF_vect) {
+    _overflows++;
+}
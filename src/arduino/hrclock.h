@@ -0,0 +1,26 @@
+#ifndef HRCLOCK_H_
+#define HRCLOCK_H_
+
+#include <stdint.h>
+
+// High resolution free-running clock on Timer1.
+// Timer1 also generates the right motor PWM, so it runs in 8 bit fast PWM
+// mode at clk/8: it only ever counts up, which keeps input capture values
+// and timestamps unambiguous. Its overflows are counted in software to
+// extend the count to 32 bits of 0.5 us, wrapping every ~35 minutes.
+
+#define HRCLOCK_TICKS_PER_US 2
+
+// Configure Timer1's clock and waveform and start counting overflows.
+// Call with interrupts disabled, before setupMotors().
+void setupHrClock();
+
+// Current time in HRCLOCK ticks. Compare with unsigned subtraction.
+uint32_t hrClockNow();
+
+// Extend an 8 bit count captured by Timer1 (e.g. ICR1L) into a full
+// timestamp. Only valid with interrupts disabled, i.e. from an ISR, and
+// within one overflow period (128 us) of the capture.
+uint32_t hrClockExtend(uint8_t count);
+
+#endif /* HRCLOCK_H_ */
@@ -0,0 +1,112 @@
+#include "params.h"
+#include "hal.h"
+
+// Where the table lives in EEPROM, and what marks it as ours
+#define PARAMS_EEPROM_ADDR 0
+#define PARAMS_MAGIC 0xA1E5
+
+typedef struct {
+    uint16_t defaultValue;
+    uint16_t min;
+    uint16_t max;
+} TParamInfo;
+
+// In TParam order, see constants.h
+static const TParamInfo PARAM_INFO[] = {
+    {2042, 1000, 5000},  // PARAM_WHEEL_CIRC
+    {1709, 500, 5000},   // PARAM_TURN_DIAMETER
+    {6, 2, 100},         // PARAM_NEAR_CM
+    {22, 0, 1000},       // PARAM_RED_MAX
+    {35, 0, 1000},       // PARAM_RED_GREEN_MIN
+    {8, 0, 1000},        // PARAM_GREEN_BLUE_MAX
+    {2560, 0, 32767},    // PARAM_SPEED_KP
+    {512, 0, 32767},     // PARAM_SPEED_KI
+    {0, 0, 32767},       // PARAM_SPEED_KD
+};
+
+static_assert(sizeof(PARAM_INFO) / sizeof(PARAM_INFO[0]) == PARAM_COUNT,
+              "every parameter needs a default and range");
+static_assert(PARAM_COUNT <= 16, "parameters must fit in RESP_PARAMS");
+
+// As stored. "count" lets firmware with more parameters keep the values of
+// the ones an older table has.
+typedef struct {
+    uint16_t magic;
+    uint8_t count;
+    uint8_t checksum;  // XOR of the values' bytes
+    uint16_t values[PARAM_COUNT];
+} TParamTable;
+
+static TParamTable _table;
+static void (*_onChange)(TParam param) = 0;
+
+static uint8_t checksum(const TParamTable* table, uint8_t count) {
+    const uint8_t* bytes = (const uint8_t*)table->values;
+    uint8_t sum = 0;
+
+    for (uint8_t i = 0; i < count * sizeof(uint16_t); i++) {
+        sum ^= bytes[i];
+    }
+
+    return sum;
+}
+
+static int inRange(uint8_t param, uint32_t value) {
+    return value >= PARAM_INFO[param].min && value <= PARAM_INFO[param].max;
+}
+
+void setupParams(void (*onChange)(TParam param)) {
+    _onChange = onChange;
+
+    TParamTable stored;
+    halEepromRead(PARAMS_EEPROM_ADDR, &stored, sizeof(stored));
+
+    uint8_t valid = stored.magic == PARAMS_MAGIC &&
+                    stored.count <= PARAM_COUNT &&
+                    stored.checksum == checksum(&stored, stored.count);
+
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        if (valid && i < stored.count && inRange(i, stored.values[i])) {
+            _table.values[i] = stored.values[i];
+        } else {
+            _table.values[i] = PARAM_INFO[i].defaultValue;
+        }
+    }
+
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        _onChange((TParam)i);
+    }
+}
+
+uint16_t getParam(TParam param) {
+    return _table.values[param];
+}
+
+int validParam(uint32_t param, uint32_t value) {
+    return param < PARAM_COUNT && inRange(param, value);
+}
+
+int setParam(TParam param, uint32_t value) {
+    if (!validParam(param, value)) {
+        return 0;
+    }
+
+    _table.values[param] = value;
+    _onChange(param);
+
+    return 1;
+}
+
+void defaultParams() {
+    for (uint8_t i = 0; i < PARAM_COUNT; i++) {
+        setParam((TParam)i, PARAM_INFO[i].defaultValue);
+    }
+}
+
+void saveParams() {
+    _table.magic = PARAMS_MAGIC;
+    _table.count = PARAM_COUNT;
+    _table.checksum = checksum(&_table, PARAM_COUNT);
+
+    halEepromWrite(PARAMS_EEPROM_ADDR, &_table, sizeof(_table));
+}
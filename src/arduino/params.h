@@ -0,0 +1,34 @@
+#ifndef PARAMS_H_
+#define PARAMS_H_
+
+#include <stdint.h>
+#include "constants.h"
+
+// Tunable parameters (TParam), held in RAM and saved to EEPROM on request.
+// setupParams() loads them at start-up. A table that was never saved,
+// is corrupt or is from firmware with fewer parameters falls back to the
+// defaults, as does any value outside its parameter's range.
+//
+// Nothing reads them in an ISR or control loop. Whatever those depend on
+// is worked out again by the handler given to setupParams() each time a
+// parameter changes.
+
+// Load the table, then call "onChange" for every parameter
+void setupParams(void (*onChange)(TParam param));
+
+uint16_t getParam(TParam param);
+
+// 1 if "param" exists and "value" is within its range
+int validParam(uint32_t param, uint32_t value);
+
+// Change a parameter until the next reset, or for good after saveParams().
+// Returns 0, and changes nothing, unless validParam().
+int setParam(TParam param, uint32_t value);
+
+// Every parameter back to its default
+void defaultParams();
+
+// Write the table to EEPROM. Blocks for up to ~80 ms, see halEepromWrite().
+void saveParams();
+
+#endif /* PARAMS_H_ */
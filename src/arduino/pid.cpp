@@ -0,0 +1,46 @@
+#include "pid.h"
+
+void pidSetGains(TPid* pid, int16_t kp, int16_t ki, int16_t kd) {
+    pid->kp = kp < 0 ? 0 : kp;
+    pid->ki = ki < 0 ? 0 : ki;
+    pid->kd = kd < 0 ? 0 : kd;
+
+    // Bounds ki * integral, so it cannot overflow either
+    pid->iLimit = pid->ki ? ((int32_t)PID_MAX_OUTPUT << 16) / pid->ki : 0;
+
+    pidReset(pid);
+}
+
+void pidReset(TPid* pid) {
+    pid->integral = 0;
+    pid->lastError = 0;
+}
+
+int16_t pidStep(TPid* pid, int16_t error) {
+    if (error > PID_MAX_ERROR) {
+        error = PID_MAX_ERROR;
+    } else if (error < -PID_MAX_ERROR) {
+        error = -PID_MAX_ERROR;
+    }
+
+    int32_t integral = pid->integral + error;
+    if (integral > pid->iLimit) {
+        integral = pid->iLimit;
+    } else if (integral < -pid->iLimit) {
+        integral = -pid->iLimit;
+    }
+    pid->integral = integral;
+
+    int32_t out = (int32_t)pid->kp * error + (int32_t)pid->ki * integral +
+                  (int32_t)pid->kd * (error - pid->lastError);
+    pid->lastError = error;
+
+    out >>= 16;
+    if (out > PID_MAX_OUTPUT) {
+        return PID_MAX_OUTPUT;
+    }
+    if (out < -PID_MAX_OUTPUT) {
+        return -PID_MAX_OUTPUT;
+    }
+    return out;
+}
@@ -0,0 +1,40 @@
+#ifndef PID_H_
+#define PID_H_
+
+#include <stdint.h>
+
+// Integer PID controller, cheap enough to run in an ISR.
+// Gains and errors are both Q8 fixed point (256 is 1.0) and the output is
+// a plain integer, e.g. with the error in ticks per period and the output
+// in PWM counts, kp = 256 adds one count per tick per period of error.
+
+typedef struct {
+    int16_t kp;
+    int16_t ki;
+    int16_t kd;
+
+    // Sum of past errors, clamped to +-iLimit so the integral term alone
+    // never exceeds PID_MAX_OUTPUT
+    int32_t integral;
+    int32_t iLimit;
+
+    int16_t lastError;
+} TPid;
+
+// Largest correction pidStep() returns either way, a full PWM range
+#define PID_MAX_OUTPUT 255
+
+// Largest error pidStep() takes either way, so no term can overflow
+#define PID_MAX_ERROR 0x3FFF
+
+// Set the gains and start from rest. Gains are clamped to 0 and above.
+void pidSetGains(TPid* pid, int16_t kp, int16_t ki, int16_t kd);
+
+// Forget the integral and last error, e.g. at the start of a move
+void pidReset(TPid* pid);
+
+// Feed in this period's error (target - measured), clamped to +-PID_MAX_ERROR.
+// Returns the correction, within +-PID_MAX_OUTPUT.
+int16_t pidStep(TPid* pid, int16_t error);
+
+#endif /* PID_H_ */
@@ -0,0 +1,77 @@
+#include "pose.h"
+#include "hal.h"
+
+// sin(pi/2 * t) ~= t * (A - t^2 * (B - t^2 * C)) for t in 0..1, exact at
+// both ends and level at t = 1, in Q14: A = pi/2, B = pi - 5/2,
+// C = pi/2 - 3/2
+#define SIN_A_Q14 25736
+#define SIN_B_Q14 10512
+#define SIN_C_Q14 1160
+
+static TPose _pose;
+
+// Heading change per tick of difference between the wheels, 2^32 to the turn
+static int32_t _headingPerTick;
+
+int16_t sinQ14(uint16_t angle) {
+    // Fold onto the first quarter turn, t in Q14
+    int32_t t = angle & 0x7FFF;
+    if (t > 0x4000) {
+        t = 0x8000 - t;
+    }
+
+    int32_t t2 = (t * t) >> 14;
+    int32_t y = SIN_B_Q14 - ((SIN_C_Q14 * t2) >> 14);
+    y = SIN_A_Q14 - ((t2 * y) >> 14);
+    y = (t * y) >> 14;
+
+    return (angle & 0x8000) ? -y : y;
+}
+
+void setupPose(uint32_t wheelTicksPerDegQ16) {
+    setPoseScale(wheelTicksPerDegQ16);
+    resetPose();
+}
+
+void setPoseScale(uint32_t wheelTicksPerDegQ16) {
+    // Turning a degree moves the wheels 2 * wheelTicksPerDeg apart, and a
+    // degree is 2^32 / 360. Float, once, rather than a 64 bit division.
+    int32_t headingPerTick =
+        (int32_t)(4294967296.0 / 720 * 65536 / wheelTicksPerDegQ16 + 0.5);
+
+    // 32 bits, and poseUpdate() may be reading it from an ISR
+    uint8_t state = halIrqSave();
+    _headingPerTick = headingPerTick;
+    halIrqRestore(state);
+}
+
+void poseUpdate(int8_t leftTicks, int8_t rightTicks) {
+    if (leftTicks == 0 && rightTicks == 0) {
+        return;
+    }
+
+    int32_t turn = (int32_t)(rightTicks - leftTicks) * _headingPerTick;
+    uint16_t midway = (_pose.heading + turn / 2) >> 16;
+
+    // Mean of the two wheels, Q8
+    int16_t travel = ((int16_t)leftTicks + rightTicks) * 128;
+
+    // Round to nearest, or truncation drags both axes towards -infinity
+    _pose.x += ((int32_t)travel * sinQ14(midway + 0x4000) + 0x2000) >> 14;
+    _pose.y += ((int32_t)travel * sinQ14(midway) + 0x2000) >> 14;
+    _pose.heading += turn;
+}
+
+void readPose(TPose* pose) {
+    uint8_t state = halIrqSave();
+    *pose = _pose;
+    halIrqRestore(state);
+}
+
+void resetPose() {
+    uint8_t state = halIrqSave();
+    _pose.x = 0;
+    _pose.y = 0;
+    _pose.heading = 0;
+    halIrqRestore(state);
+}
@@ -0,0 +1,39 @@
+#ifndef POSE_H_
+#define POSE_H_
+
+#include <stdint.h>
+
+// Dead reckoning for a differential drive. Signed wheel ticks are
+// integrated into (x, y, heading) in fixed point, with integer maths only
+// and no lookup tables, cheap enough for poseUpdate() to run in an ISR.
+// Heading changes by the right minus the left wheel's travel over the
+// turning diameter; position moves by their mean along the heading halfway
+// through the step.
+
+typedef struct {
+    int32_t x;         // Encoder ticks, Q8, along the starting heading
+    int32_t y;         // Encoder ticks, Q8, to the left of it
+    uint32_t heading;  // Anticlockwise, 2^32 to the turn
+} TPose;
+
+// Start at the origin, for a robot whose wheels each cover
+// "wheelTicksPerDegQ16" (Q16) ticks per degree of turning on the spot
+void setupPose(uint32_t wheelTicksPerDegQ16);
+
+// Recalibrate, as for setupPose(), keeping the pose so far
+void setPoseScale(uint32_t wheelTicksPerDegQ16);
+
+// Advance by each wheel's ticks since the last call, positive forwards.
+// Call at a fixed rate, often enough that neither exceeds +-127.
+void poseUpdate(int8_t leftTicks, int8_t rightTicks);
+
+// The latest pose, consistent even against poseUpdate() from an ISR
+void readPose(TPose* pose);
+
+// Back to the origin
+void resetPose();
+
+// sin of "angle" in 65536ths of a turn, Q14, within 0.1% of full scale
+int16_t sinQ14(uint16_t angle);
+
+#endif /* POSE_H_ */
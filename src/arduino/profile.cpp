@@ -0,0 +1,90 @@
+#include "profile.h"
+
+#ifdef PROFILE
+
+#include "hal.h"
+
+// Times in hrclock ticks. Regions record from ISRs as well as the main
+// loop, so every access is made with interrupts disabled.
+typedef struct {
+    uint32_t calls;
+    uint32_t total;
+    uint16_t min;
+    uint16_t max;
+} TProfileEntry;
+
+static TProfileEntry _table[PROFILE_REGIONS];
+
+// Ticks between the two timestamps of an empty region
+static uint16_t _overhead = 0;
+
+void setupProfiler() {
+    // Keep the fastest of a few, in case Timer1 overflows in between
+    uint16_t best = 0xFFFF;
+    for (uint8_t i = 0; i < 4; i++) {
+        uint32_t start = hrClockNow();
+        uint32_t time = hrClockNow() - start;
+        if (time < best) {
+            best = time;
+        }
+    }
+    _overhead = best;
+
+    profileClear();
+}
+
+void profileRecord(TProfileRegion region, uint32_t start) {
+    uint32_t elapsed = hrClockNow() - start;
+    elapsed = elapsed > _overhead ? elapsed - _overhead : 0;
+    uint16_t time = elapsed > 0xFFFF ? 0xFFFF : elapsed;
+
+    uint8_t state = halIrqSave();
+
+    // Calls and total stop together, so the average stays right
+    TProfileEntry* entry = &_table[region];
+    if (entry->calls != 0xFFFFFFFF && entry->total + time >= entry->total) {
+        entry->calls++;
+        entry->total += time;
+    }
+    if (time < entry->min) {
+        entry->min = time;
+    }
+    if (time > entry->max) {
+        entry->max = time;
+    }
+
+    halIrqRestore(state);
+}
+
+void profileRead(TProfileRegion region, TProfileStats* stats) {
+    uint8_t state = halIrqSave();
+    TProfileEntry entry = _table[region];
+    halIrqRestore(state);
+
+    stats->calls = entry.calls;
+    if (entry.calls == 0) {
+        stats->minCycles = 0;
+        stats->avgCycles = 0;
+        stats->maxCycles = 0;
+        return;
+    }
+
+    stats->minCycles = (uint32_t)entry.min * PROFILE_CYCLES_PER_TICK;
+    stats->avgCycles = entry.total / entry.calls * PROFILE_CYCLES_PER_TICK;
+    stats->maxCycles = (uint32_t)entry.max * PROFILE_CYCLES_PER_TICK;
+}
+
+void profileClear() {
+    uint8_t state = halIrqSave();
+
+    for (uint8_t i = 0; i < PROFILE_REGIONS; i++) {
+        _table[i].calls = 0;
+        _table[i].total = 0;
+        _table[i].min = 0xFFFF;
+        _table[i].max = 0;
+    }
+
+    halIrqRestore(state);
+}
+
+#endif /* PROFILE */
@@ -0,0 +1,58 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include <stdint.h>
+#include "constants.h"
+#include "hrclock.h"
+
+// Opt-in execution time profiler, built in with "make PROFILE=1".
+// PROFILE_BEGIN/PROFILE_END bracket a region with hrclock timestamps, and
+// each region's call count and min/total/max time collect in a small
+// table. Without PROFILE the markers expand to nothing and none of this is
+// compiled in.
+//
+// Resolution is one Timer1 count, i.e. 8 CPU cycles. The cost of the
+// markers themselves is left out, but a region's time includes any
+// interrupt that fires inside it.
+//
+//     void sendStatus() {
+//         PROFILE_BEGIN(PROFILE_SEND_STATUS);
+//         ...
+//         PROFILE_END(PROFILE_SEND_STATUS);
+//     }
+
+#ifdef PROFILE
+
+// CPU cycles per hrclock tick
+#define PROFILE_CYCLES_PER_TICK (F_CPU / 1000000UL / HRCLOCK_TICKS_PER_US)
+
+typedef struct {
+    uint32_t calls;
+    uint32_t minCycles;
+    uint32_t avgCycles;
+    uint32_t maxCycles;
+} TProfileStats;
+
+// Measure what an empty region costs. Call after setupHrClock(), with
+// interrupts disabled.
+void setupProfiler();
+
+// Add a region that started at hrclock time "start". Use PROFILE_END.
+void profileRecord(TProfileRegion region, uint32_t start);
+
+// Copy out one region's results, all zero if it never ran
+void profileRead(TProfileRegion region, TProfileStats* stats);
+
+void profileClear();
+
+#define PROFILE_BEGIN(region) uint32_t _profileStart##region = hrClockNow()
+#define PROFILE_END(region) profileRecord(region, _profileStart##region)
+
+#else
+
+#define PROFILE_BEGIN(region)
+#define PROFILE_END(region)
+
+#endif /* PROFILE */
+
+#endif /* PROFILE_H_ */
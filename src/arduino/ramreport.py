@@ -0,0 +1,235 @@
+#!/usr/bin/env python3
+"""SRAM report for the firmware ELF.
+
+Prints static RAM (.data, .bss, .noinit), the worst-case stack depth of
+main() and of each ISR with the call chain that reaches it, and the
+headroom left. Stack use comes from the disassembly: each function's
+prologue pushes and frame allocation, plus 2 bytes per call. ISRs do not
+nest, so the worst case is main() plus the deepest ISR.
+
+Calls through function pointers cannot be seen in the code, so list them
+with --indirect CALLER:CALLEE. Exits non-zero if the stack is unbounded
+(recursion, an unlisted indirect call) or RAM is overcommitted.
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+# Return address size on devices with up to 128 KB of flash
+PC_BYTES = 2
+
+# ATmega328P interrupt vectors, for readable output
+VECTORS = {
+    1: "INT0", 2: "INT1", 3: "PCINT0", 4: "PCINT1", 5: "PCINT2",
+    6: "WDT", 7: "TIMER2_COMPA", 8: "TIMER2_COMPB", 9: "TIMER2_OVF",
+    10: "TIMER1_CAPT", 11: "TIMER1_COMPA", 12: "TIMER1_COMPB",
+    13: "TIMER1_OVF", 14: "TIMER0_COMPA", 15: "TIMER0_COMPB",
+    16: "TIMER0_OVF", 17: "SPI_STC", 18: "USART_RX", 19: "USART_UDRE",
+    20: "USART_TX", 21: "ADC", 22: "EE_READY", 23: "ANALOG_COMP",
+    24: "TWI", 25: "SPM_READY",
+}
+
+FUNC_RE = re.compile(r"^[0-9a-f]+ <([^>]+)>:$")
+INSN_RE = re.compile(r"^\s*[0-9a-f]+:\s+(\S+)\s*([^;]*)(?:;.*<([^>]+)>)?")
+SECTION_RE = re.compile(r"^\s*\d+\s+(\.\S+)\s+([0-9a-f]+)\s")
+
+
+class Function:
+    def __init__(self, name):
+        self.name = name
+        self.frame = 0
+        self.calls = set()
+        self.jumps = set()
+        self.indirect = False
+
+
+def number(text):
+    return int(text, 0)
+
+
+def run(cmd):
+    return subprocess.run(cmd, check=True, capture_output=True,
+                          text=True).stdout
+
+
+def parse_functions(disassembly):
+    functions = {}
+    current = None
+    seen_sp = False
+    allocated = False
+    pending_subi = None
+
+    for line in disassembly.splitlines():
+        match = FUNC_RE.match(line)
+        if match:
+            current = Function(match.group(1))
+            functions[current.name] = current
+            seen_sp = allocated = False
+            pending_subi = None
+            continue
+
+        match = INSN_RE.match(line)
+        if not current or not match:
+            continue
+
+        op, args, target = match.group(1), match.group(2).strip(), match.group(3)
+        regs = [a.strip() for a in args.split(",")]
+
+        # A large frame is "subi r28, lo" then "sbci r29, hi"
+        if pending_subi is not None:
+            if op == "sbci" and regs[0] == "r29":
+                current.frame += number(regs[1]) << 8
+            pending_subi = None
+
+        if op == "push":
+            current.frame += 1
+        elif op == "rcall" and args == ".+0":
+            # Reserves PC_BYTES of frame in one word
+            current.frame += PC_BYTES
+        elif op == "in" and regs[0] == "r28" and regs[1] == "0x3d":
+            seen_sp = True
+        elif seen_sp and not allocated and op in ("sbiw", "subi") \
+                and regs[0] == "r28":
+            allocated = True
+            current.frame += number(regs[1])
+            if op == "subi":
+                pending_subi = True
+        elif op in ("icall", "eicall", "ijmp", "eijmp"):
+            current.indirect = True
+        elif op in ("call", "rcall") and target and "+" not in target:
+            current.calls.add(target)
+        elif op in ("jmp", "rjmp") and target and "+" not in target \
+                and target != current.name:
+            # Tail call, our own frame is already gone
+            current.jumps.add(target)
+
+    return functions
+
+
+def worst_case(functions, root, hints):
+    """Returns (bytes, chain, problem) for the deepest path from root."""
+    memo = {}
+    active = set()
+
+    def visit(name):
+        if name in memo:
+            return memo[name]
+        if name in active:
+            return 0, [name], "recursion through " + name
+        function = functions.get(name)
+        if function is None:
+            return 0, [name], None
+
+        active.add(name)
+        best = (0, [])
+        problem = None
+
+        callees = set(function.calls)
+        if function.indirect:
+            targets = hints.get(name)
+            if targets:
+                callees |= targets
+            else:
+                problem = "unlisted indirect call in " + name
+
+        for callee in callees:
+            depth, chain, issue = visit(callee)
+            if depth + PC_BYTES > best[0]:
+                best = (depth + PC_BYTES, chain)
+            problem = problem or issue
+
+        result = (function.frame + best[0], [name] + best[1], None)
+        for callee in function.jumps:
+            depth, chain, issue = visit(callee)
+            if depth > result[0]:
+                result = (depth, [name] + chain, None)
+            problem = problem or issue
+
+        active.discard(name)
+        memo[name] = (result[0], result[1], problem)
+        return memo[name]
+
+    return visit(root)
+
+
+def demangler(names):
+    try:
+        out = run(["c++filt"] + sorted(names))
+    except (OSError, subprocess.CalledProcessError):
+        return {}
+    return dict(zip(sorted(names), out.splitlines()))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf")
+    parser.add_argument("--objdump", default="avr-objdump")
+    parser.add_argument("--ram", type=int, default=2048,
+                        help="SRAM size in bytes")
+    parser.add_argument("--indirect", action="append", default=[],
+                        metavar="CALLER:CALLEE")
+    args = parser.parse_args()
+
+    hints = {}
+    for hint in args.indirect:
+        caller, callee = hint.split(":")
+        hints.setdefault(caller, set()).add(callee)
+
+    static = 0
+    sections = []
+    for line in run([args.objdump, "-h", args.elf]).splitlines():
+        match = SECTION_RE.match(line)
+        if match and match.group(1) in (".data", ".bss", ".noinit"):
+            size = int(match.group(2), 16)
+            static += size
+            sections.append("%s %d" % (match.group(1), size))
+
+    functions = parse_functions(
+        run([args.objdump, "-d", "--no-show-raw-insn", args.elf]))
+
+    # Startup code calls main(), so it too costs a return address
+    roots = [("main", "main", PC_BYTES)]
+    for name in sorted(functions):
+        match = re.match(r"__vector_(\d+)$", name)
+        if match:
+            vector = int(match.group(1))
+            label = VECTORS.get(vector, name)
+            roots.append((name, label, PC_BYTES))
+
+    results = []
+    problems = []
+    for name, label, entry in roots:
+        depth, chain, problem = worst_case(functions, name, hints)
+        results.append((label, depth + entry, chain))
+        if problem:
+            problems.append(problem)
+
+    names = demangler({n for _, _, chain in results for n in chain})
+    width = max(len(label) for label, _, _ in results)
+
+    print("Static RAM: %s = %d bytes" % (" + ".join(sections), static))
+    print("Worst-case stack per entry point:")
+    for label, depth, chain in results:
+        print("  %-*s %5d  %s" % (width, label, depth,
+                                   " -> ".join(names.get(n, n) for n in chain)))
+
+    main_depth = results[0][1]
+    isr = max(results[1:], key=lambda r: r[1], default=("none", 0, []))
+    stack = main_depth + isr[1]
+    headroom = args.ram - static - stack
+
+    print("Worst-case stack: main %d + %s %d = %d bytes"
+          % (main_depth, isr[0], isr[1], stack))
+    print("Headroom: %d - %d - %d = %d bytes"
+          % (args.ram, static, stack, headroom))
+
+    for problem in sorted(set(problems)):
+        print("WARNING: stack unbounded, " + problem, file=sys.stderr)
+
+    return 1 if problems or headroom < 0 else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
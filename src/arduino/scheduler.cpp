@@ -0,0 +1,101 @@
+#include "scheduler.h"
+#include "hrclock.h"
+#include "systick.h"
+
+typedef struct {
+    void (*run)(void);
+    uint16_t period;
+    uint8_t priority;
+    uint8_t id;
+    uint32_t due;
+    TTaskStats stats;
+} TTask;
+
+// Kept sorted by priority
+static TTask _tasks[MAX_TASKS];
+static uint8_t _count = 0;
+
+int addTask(void (*run)(void), uint16_t periodMs, uint8_t priority) {
+    if (_count == MAX_TASKS) {
+        return -1;
+    }
+
+    // Insert after every task of the same or higher priority
+    uint8_t i = _count;
+    while (i > 0 && _tasks[i - 1].priority > priority) {
+        _tasks[i] = _tasks[i - 1];
+        i--;
+    }
+
+    TTask* task = &_tasks[i];
+    task->run = run;
+    task->period = periodMs;
+    task->priority = priority;
+    task->id = _count;
+    task->due = sysTickMillis() + periodMs;
+    task->stats.runs = 0;
+    task->stats.missed = 0;
+    task->stats.lastTime = 0;
+    task->stats.maxTime = 0;
+
+    return _count++;
+}
+
+static void runTask(TTask* task) {
+    if (task->period) {
+        uint32_t now = sysTickMillis();
+
+        // Next run is a period after this one was due, unless we are a
+        // whole period or more late: count that and start afresh.
+        if (now - task->due >= task->period) {
+            task->stats.missed++;
+            task->due = now + task->period;
+        } else {
+            task->due += task->period;
+        }
+    }
+
+    uint32_t start = hrClockNow();
+    task->run();
+    uint32_t time = hrClockNow() - start;
+
+    task->stats.runs++;
+    task->stats.lastTime = time > 0xFFFF ? 0xFFFF : time;
+    if (task->stats.lastTime > task->stats.maxTime) {
+        task->stats.maxTime = task->stats.lastTime;
+    }
+}
+
+void runTasks() {
+    // Only what is due by now, so each timed task runs at most once per
+    // call even if it overruns its own period
+    uint32_t now = sysTickMillis();
+    uint8_t i = 0;
+
+    while (i < _count) {
+        TTask* task = &_tasks[i];
+
+        if (task->period == 0) {
+            runTask(task);
+        } else if ((int32_t)(now - task->due) >= 0) {
+            runTask(task);
+
+            // Give the more urgent tasks another go before the next one
+            i = 0;
+            continue;
+        }
+
+        i++;
+    }
+}
+
+int taskStats(uint8_t id, TTaskStats* stats) {
+    for (uint8_t i = 0; i < _count; i++) {
+        if (_tasks[i].id == id) {
+            *stats = _tasks[i].stats;
+            return 1;
+        }
+    }
+
+    return 0;
+}
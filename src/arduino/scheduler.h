@@ -0,0 +1,34 @@
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stdint.h>
+
+// Cooperative task scheduler on the systick clock.
+// Each task has a period and a priority. runTasks() runs every task that
+// is due, highest priority (lowest number) first, and after each timed task
+// starts again from the top, so short high-priority work such as motion
+// supervision never waits behind more than one lower-priority task.
+// Tasks run to completion, so they must not block.
+
+#define MAX_TASKS 8
+
+typedef struct {
+    uint32_t runs;
+    uint32_t missed;    // Started a whole period or more late
+    uint16_t lastTime;  // Run time in hrclock ticks, saturating
+    uint16_t maxTime;
+} TTaskStats;
+
+// Call "run" every "periodMs" ms, or on every runTasks() pass if 0 (e.g.
+// work that interrupts hand over). Lower "priority" runs first; tasks of
+// equal priority run in the order they were added. Returns the task id,
+// or -1 if all MAX_TASKS slots are taken.
+int addTask(void (*run)(void), uint16_t periodMs, uint8_t priority);
+
+// Run everything that is due, then return. Call from loop().
+void runTasks();
+
+// Copy task "id"'s statistics into "stats". Returns 0 for an unknown id.
+int taskStats(uint8_t id, TTaskStats* stats);
+
+#endif /* SCHEDULER_H_ */
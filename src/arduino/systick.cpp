@@ -0,0 +1,40 @@
+#include "systick.h"
+#include "hal.h"
+
+static volatile uint32_t _millis = 0;
+
+// Owned by the ISR once set up
+static void (*_handler)(void) = 0;
+static uint8_t _period = 0;
+static uint8_t _untilHandler = 0;
+
+void setupSysTick() {
+    halTickSetup();
+}
+
+uint32_t sysTickMillis() {
+    // A 32 bit read takes several instructions, do not let the ISR
+    // update it halfway through
+    uint8_t state = halIrqSave();
+    uint32_t ms = _millis;
+    halIrqRestore(state);
+
+    return ms;
+}
+
+void setSysTickHandler(void (*handler)(void), uint8_t periodMs) {
+    uint8_t state = halIrqSave();
+    _handler = handler;
+    _period = periodMs;
+    _untilHandler = periodMs;
+    halIrqRestore(state);
+}
+
+void halTickHandler() {
+    _millis++;
+
+    if (_handler && --_untilHandler == 0) {
+        _untilHandler = _period;
+        _handler();
+    }
+}
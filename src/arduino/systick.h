@@ -0,0 +1,24 @@
+#ifndef SYSTICK_H_
+#define SYSTICK_H_
+
+#include <stdint.h>
+
+// Millisecond system tick driven by the HAL's 1 ms timer, Timer2 in CTC
+// mode on the AVR. Timer0 and Timer1 are busy generating the motor PWMs,
+// so Timer2 is the only timer left to keep time with.
+
+// Configure Timer2 to interrupt once every millisecond. Call with
+// interrupts disabled, before sei().
+void setupSysTick();
+
+// Milliseconds elapsed since setupSysTick(). Wraps after ~49 days, so
+// always compare with unsigned subtraction: (now - then) >= period.
+uint32_t sysTickMillis();
+
+// Call "handler" from the systick ISR every "periodMs" ms (1 to 255), for
+// work that must run at a fixed rate such as control loops. There is one
+// such handler; NULL removes it. It delays every other interrupt, so keep
+// it short.
+void setSysTickHandler(void (*handler)(void), uint8_t periodMs);
+
+#endif /* SYSTICK_H_ */
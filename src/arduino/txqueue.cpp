@@ -0,0 +1,75 @@
+#include "txqueue.h"
+#include "buffer.h"
+#include "hal.h"
+#include "serialize.h"
+
+static_assert((TX_SLOTS & (TX_SLOTS - 1)) == 0 && TX_SLOTS <= 128,
+              "TX_SLOTS must be a power of two up to 128");
+
+typedef struct {
+    const char* data;
+    uint8_t len;
+} TTxDescriptor;
+
+static char _frames[TX_SLOTS][PACKET_SIZE];
+static TTxDescriptor _queue[TX_SLOTS];
+
+// Free-running counts of frames queued (written by txSubmit() only) and
+// frames sent (written by the ISR only). Slot i is in use by the frame
+// numbered i modulo TX_SLOTS.
+static volatile uint8_t _queued = 0;
+static volatile uint8_t _sent = 0;
+
+// Frame being sent, owned by the ISR
+static const char* _next;
+static uint8_t _left = 0;
+
+uint8_t txFreeSlots() {
+    return TX_SLOTS - (uint8_t)(_queued - _sent);
+}
+
+char* txAcquire(int wait) {
+    while (txFreeSlots() == 0) {
+        if (!wait) {
+            return 0;
+        }
+    }
+
+    return _frames[_queued & (TX_SLOTS - 1)];
+}
+
+void txSubmit(uint8_t len) {
+    uint8_t queued = _queued;
+    TTxDescriptor* desc = &_queue[queued & (TX_SLOTS - 1)];
+
+    desc->data = _frames[queued & (TX_SLOTS - 1)];
+    desc->len = len;
+    BUFFER_BARRIER();
+    _queued = queued + 1;
+
+    halUartStartTx();
+}
+
+int16_t halUartTxHandler() {
+    if (_left == 0) {
+        uint8_t sent = _sent;
+
+        if (sent == _queued) {
+            // Nothing left, txSubmit() starts us again
+            return -1;
+        }
+
+        TTxDescriptor* desc = &_queue[sent & (TX_SLOTS - 1)];
+        _next = desc->data;
+        _left = desc->len;
+    }
+
+    uint8_t data = *_next++;
+
+    if (--_left == 0) {
+        // Last byte is going to the UART, the slot can be reused
+        _sent = _sent + 1;
+    }
+
+    return data;
+}
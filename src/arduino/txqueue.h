@@ -0,0 +1,30 @@
+#ifndef TXQUEUE_H_
+#define TXQUEUE_H_
+
+#include <stdint.h>
+
+// Interrupt-driven UART transmit of whole frames.
+// Callers serialise straight into one of TX_SLOTS frame slots and queue a
+// descriptor (start and length) for it. The UART transmit interrupt
+// (halUartTxHandler()) walks the descriptor and sends from the slot
+// itself, then hands the slot back. A frame is either queued whole or not
+// at all.
+
+// Frames that can be queued or in flight at once. A power of two; each
+// slot costs PACKET_SIZE bytes of SRAM, even for a compact frame. Two let
+// the next reply be built while one goes out.
+#define TX_SLOTS 2
+
+// Slots free for txAcquire() right now
+uint8_t txFreeSlots();
+
+// A free slot to build the next frame in, PACKET_SIZE bytes long. If none
+// is free, waits for the ISR to send one when "wait" is set, else returns
+// NULL. Never wait with interrupts disabled.
+char* txAcquire(int wait);
+
+// Queue the first "len" bytes of the slot txAcquire() just returned and
+// start sending if the UART is idle.
+void txSubmit(uint8_t len);
+
+#endif /* TXQUEUE_H_ */
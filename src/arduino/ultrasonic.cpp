@@ -0,0 +1,157 @@
+#include "ultrasonic.h"
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include "hrclock.h"
+
+// Trigger is PB3 (pin 11), echo is PB4 (pin 12, PCINT4)
+#define TRIGGER_BIT PB3
+#define ECHO_BIT PB4
+
+// Sound covers 1 cm and back in 58 us, i.e. 116 hrclock ticks
+#define ULTRASONIC_TICKS_PER_CM (58 * HRCLOCK_TICKS_PER_US)
+
+// Trigger again even if the echo never came down, e.g. sensor unplugged
+#define ULTRASONIC_TIMEOUT_MS 60
+
+// Where in each 1 ms Timer2 cycle the trigger pulse starts, and its length
+// in 4 us Timer2 counts. The HC-SR04 wants at least 10 us.
+#define TRIGGER_START_COUNT 100
+#define TRIGGER_PULSE_COUNTS 4
+
+#define READINGS 3
+
+static void (*_onNear)(void) = 0;
+
+// Owned by the Timer2 compare B ISR
+static uint8_t _triggering = 0;
+static uint8_t _sincePing = 0;
+
+// Owned by the echo ISR
+static uint8_t _echoHigh = 0;
+static uint32_t _echoStart;
+static uint16_t _readings[READINGS];
+static uint8_t _next = 0;
+
+// Filtered echo width in hrclock ticks
+static volatile uint16_t _filtered = 0xFFFF;
+
+// Echoes shorter than this are near, i.e. ultrasonicDistance() <= near cm
+static volatile uint16_t _nearTicks =
+    (ULTRASONIC_NEAR_CM + 1) * ULTRASONIC_TICKS_PER_CM;
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+    if (a > b) {
+        uint16_t t = a;
+        a = b;
+        b = t;
+    }
+    if (b > c) {
+        b = c;
+    }
+    return a > b ? a : b;
+}
+
+void setupUltrasonic(void (*onNear)(void)) {
+    _onNear = onNear;
+
+    for (uint8_t i = 0; i < READINGS; i++) {
+        _readings[i] = 0xFFFF;
+    }
+
+    // Trigger as output and low, echo as input
+    DDRB |= _BV(TRIGGER_BIT);
+    PORTB &= ~_BV(TRIGGER_BIT);
+    DDRB &= ~_BV(ECHO_BIT);
+
+    // Echo edges through pin change interrupt 4
+    PCMSK0 |= _BV(PCINT4);
+    PCIFR = _BV(PCIE0);
+    PCICR |= _BV(PCIE0);
+
+    // Once per Timer2 cycle, i.e. every ms
+    OCR2B = TRIGGER_START_COUNT;
+    TIFR2 = _BV(OCF2B);
+    TIMSK2 |= _BV(OCIE2B);
+}
+
+int ultrasonicDistance() {
+    // 16 bit read, do not let the echo ISR change it halfway
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t filtered = _filtered;
+    SREG = sreg;
+
+    return filtered / ULTRASONIC_TICKS_PER_CM;
+}
+
+int ultrasonicNear() {
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t filtered = _filtered;
+    SREG = sreg;
+
+    return filtered < _nearTicks;
+}
+
+void setUltrasonicNear(uint8_t cm) {
+    uint16_t ticks = (cm + 1) * ULTRASONIC_TICKS_PER_CM;
+
+    uint8_t sreg = SREG;
+    cli();
+    _nearTicks = ticks;
+    SREG = sreg;
+}
+
+ISR(TIMER2_COMPB_vect) {
+    if (_triggering) {
+        // End of the trigger pulse, back to once per cycle
+        PORTB &= ~_BV(TRIGGER_BIT);
+        OCR2B = TRIGGER_START_COUNT;
+        _triggering = 0;
+        return;
+    }
+
+    if (_sincePing < 0xFF) {
+        _sincePing++;
+    }
+
+    if (_sincePing < ULTRASONIC_INTERVAL_MS) {
+        return;
+    }
+
+    // Wait for the last echo to end, or give up on it
+    if ((PINB & _BV(ECHO_BIT)) && _sincePing < ULTRASONIC_TIMEOUT_MS) {
+        return;
+    }
+
+    _sincePing = 0;
+    PORTB |= _BV(TRIGGER_BIT);
+    OCR2B = TRIGGER_START_COUNT + TRIGGER_PULSE_COUNTS;
+    _triggering = 1;
+}
+
+ISR(PCINT0_vect) {
+    uint32_t now = hrClockNow();
+
+    if (PINB & _BV(ECHO_BIT)) {
+        _echoStart = now;
+        _echoHigh = 1;
+        return;
+    }
+
+    if (!_echoHigh) {
+        return;
+    }
+    _echoHigh = 0;
+
+    uint32_t width = now - _echoStart;
+    _readings[_next] = width > 0xFFFF ? 0xFFFF : width;
+    _next = _next + 1 == READINGS ? 0 : _next + 1;
+
+    uint16_t filtered = median3(_readings[0], _readings[1], _readings[2]);
+    _filtered = filtered;
+
+    if (filtered < _nearTicks && _onNear) {
+        _onNear();
+    }
+}
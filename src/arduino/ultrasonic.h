@@ -0,0 +1,41 @@
+#ifndef ULTRASONIC_H_
+#define ULTRASONIC_H_
+
+#include <stdint.h>
+
+// Background HC-SR04 ranging.
+// Timer2 compare B (Timer2 already ticks every ms for systick) fires the
+// trigger pulse on PB3 every ULTRASONIC_INTERVAL_MS, once the previous echo
+// has ended. Both edges of the echo on PB4 are timestamped through PCINT4
+// with hrclock, and the distance is the median of the last three pings.
+//
+// Worst-case emergency-stop latency, obstacle appearing at distance
+// <= ULTRASONIC_NEAR_CM to PWM cut:
+//   up to 39 ms  for the ping already in flight to finish (no-echo pulses
+//                last 38 ms) and the next one to be triggered,
+//   + 30 ms      for a second near ping to outvote the far one,
+//   + 0.4 ms     for that echo (6 cm round trip),
+//   + ~10 us     for the echo ISR to call the near handler.
+// So motors stop within ~70 ms, ~2 cm of travel at full speed.
+
+// Obstacles this close or closer count as near, until setUltrasonicNear()
+#define ULTRASONIC_NEAR_CM 6
+
+// Gap between pings. Leaves time for echoes from up to ~4 m to die down.
+#define ULTRASONIC_INTERVAL_MS 30
+
+// Start ranging. "onNear" is called from the echo ISR after every ping
+// whose filtered distance is near, so it must be short. May be NULL.
+// Needs setupSysTick() and setupHrClock().
+void setupUltrasonic(void (*onNear)(void));
+
+// Latest filtered distance in cm
+int ultrasonicDistance();
+
+// 1 if the latest filtered distance is within the near distance
+int ultrasonicNear();
+
+// Count obstacles "cm" or closer as near from the next ping on
+void setUltrasonicNear(uint8_t cm);
+
+#endif /* ULTRASONIC_H_ */
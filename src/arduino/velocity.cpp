@@ -0,0 +1,48 @@
+#include "velocity.h"
+
+void velocityInit(TVelocity* velocity,
+                  uint32_t period,
+                  uint8_t edges,
+                  uint32_t edgeTime) {
+    velocity->periodQ8 = period << 8;
+    velocity->edges = edges;
+    velocity->edgeTime = edgeTime;
+    velocity->speed = 0;
+}
+
+// "n" edges in "elapsed" hrclock ticks, in ticks per period, Q8
+static int16_t timedSpeed(const TVelocity* velocity,
+                          uint8_t n,
+                          uint32_t elapsed) {
+    if (elapsed == 0) {
+        return VELOCITY_MAX_Q8;
+    }
+
+    // n < VELOCITY_COUNT_EDGES, so this fits for periods up to ~1 s
+    uint32_t speed = velocity->periodQ8 * n / elapsed;
+    return speed > VELOCITY_MAX_Q8 ? VELOCITY_MAX_Q8 : speed;
+}
+
+int16_t velocityUpdate(TVelocity* velocity,
+                       uint8_t edges,
+                       uint32_t edgeTime,
+                       uint32_t now) {
+    uint8_t n = edges - velocity->edges;
+
+    if (n >= VELOCITY_COUNT_EDGES) {
+        velocity->speed = (int16_t)n << 8;
+    } else if (n > 0) {
+        velocity->speed =
+            timedSpeed(velocity, n, edgeTime - velocity->edgeTime);
+    } else {
+        int16_t bound = timedSpeed(velocity, 1, now - edgeTime);
+        if (velocity->speed > bound) {
+            velocity->speed = bound;
+        }
+    }
+
+    velocity->edges = edges;
+    velocity->edgeTime = edgeTime;
+
+    return velocity->speed;
+}
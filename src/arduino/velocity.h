@@ -0,0 +1,47 @@
+#ifndef VELOCITY_H_
+#define VELOCITY_H_
+
+#include <stdint.h>
+
+// Wheel speed from encoder edge timestamps, cheap enough to run in an ISR.
+// The encoder ISRs only count edges and note when the latest one came, in
+// hrclock ticks. Once a period, velocityUpdate() turns that into a speed
+// in ticks per period, Q8, the unit wheel speed control works in:
+//   - below VELOCITY_COUNT_EDGES edges a period it times them: n edges
+//     over the time from the last edge it saw before to the latest one.
+//     No quantisation to whole ticks per period, so creeping wheels read
+//     true.
+//   - from VELOCITY_COUNT_EDGES up it counts them, to within one part in
+//     VELOCITY_COUNT_EDGES, without a division.
+//   - with no edge at all it can only say the wheel is slower than one
+//     edge since the latest, so the speed decays towards 0 at standstill.
+
+// Edges per period from which counting beats timing
+#define VELOCITY_COUNT_EDGES 8
+
+// Fastest speed velocityUpdate() reports, e.g. for a bouncing contact
+#define VELOCITY_MAX_Q8 0x3FFF
+
+typedef struct {
+    uint32_t periodQ8;  // Update period in hrclock ticks, Q8
+    uint8_t edges;      // Edge count at the last update
+    uint32_t edgeTime;  // Time of the latest edge at the last update
+    int16_t speed;      // Ticks per period, Q8
+} TVelocity;
+
+// Start from rest, with updates every "period" hrclock ticks. "edges" and
+// "edgeTime" are the wheel's edge count and the time to count from.
+void velocityInit(TVelocity* velocity,
+                  uint32_t period,
+                  uint8_t edges,
+                  uint32_t edgeTime);
+
+// Feed in the wheel's edge count and the time of its latest edge, read
+// together with interrupts disabled, and the time now. Returns the speed,
+// also kept in velocity->speed.
+int16_t velocityUpdate(TVelocity* velocity,
+                       uint8_t edges,
+                       uint32_t edgeTime,
+                       uint32_t now);
+
+#endif /* VELOCITY_H_ */
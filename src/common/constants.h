@@ -23,12 +23,41 @@ typedef enum {
     RESP_BAD_PACKET = 2,
     RESP_BAD_CHECKSUM = 3,
     RESP_BAD_COMMAND = 4,
-    RESP_BAD_RESPONSE = 5
+    RESP_BAD_RESPONSE = 5,
+    RESP_TICKS = 6,
+    RESP_PROFILE = 7,
+    RESP_POSE = 8,
+    RESP_PARAMS = 9,
+    RESP_BAD_PARAM = 10,
+    RESP_FIELDS = 11,
+    RESP_TASKS = 12
 } TResponseType;
 
 // Commands
+// Alex answers each command with a RESP_OK, as a compact frame, once it
+// has taken it on, or with a PACKET_TYPE_ERROR. Commands that return data
+// answer with the data reply (RESP_STATUS, RESP_POSE, ...) alone.
 // For direction commands, param[0] = distance in cm to move
 // param[1] = speed
+// For COMMAND_SET_PID, param[0..2] = wheel speed kp, ki, kd in 1/256ths,
+// each 0 to 32767
+// For COMMAND_GET_PROFILE, param[0] = 1 to clear the profile once sent.
+// Firmware built without PROFILE answers RESP_BAD_COMMAND.
+// For COMMAND_GET_POSE, param[0] = 1 to reset the pose to the origin once
+// sent. In RESP_POSE, params[0] and [1] = x and y in 0.1 mm, signed, x
+// along the heading Alex started (or was last reset) at and y to its left;
+// params[2] = heading anticlockwise in 65536ths of a turn.
+// For COMMAND_GET_PARAMS, RESP_PARAMS has params[i] = the value of TParam i.
+// For COMMAND_SET_PARAM, param[0] = TParam, param[1] = value. It applies at
+// once, until the next reset; an unknown parameter or a value out of its
+// range is refused with RESP_BAD_PARAM.
+// For COMMAND_SAVE_PARAMS, param[0] = 1 to go back to the defaults first.
+// For COMMAND_GET_FIELDS, param[0] = bitwise OR of TStatusField. RESP_FIELDS
+// has params[0] = the fields it carries, then their values from params[1]
+// on, lowest field bit first. Fields that would overrun params are left
+// out of both.
+// For COMMAND_GET_TASKS, RESP_TASKS has the scheduler's statistics, see
+// TFirmwareTask.
 typedef enum {
     COMMAND_FORWARD = 0,
     COMMAND_REVERSE = 1,
@@ -36,6 +65,80 @@ typedef enum {
     COMMAND_TURN_RIGHT = 3,
     COMMAND_STOP = 4,
     COMMAND_GET_STATS = 5,
-    COMMAND_CLEAR_STATS = 6
+    COMMAND_CLEAR_STATS = 6,
+    COMMAND_SUBSCRIBE = 7,
+    COMMAND_UNSUBSCRIBE = 8,
+    COMMAND_SET_PID = 9,
+    COMMAND_GET_PROFILE = 10,
+    COMMAND_GET_POSE = 11,
+    COMMAND_GET_PARAMS = 12,
+    COMMAND_SET_PARAM = 13,
+    COMMAND_SAVE_PARAMS = 14,
+    COMMAND_GET_FIELDS = 15,
+    COMMAND_GET_TASKS = 16
 } TCommandType;
+
+// Status fields to ask COMMAND_GET_FIELDS for, with the values each puts
+// in RESP_FIELDS
+typedef enum {
+    STATUS_COLOUR = 0b01,      // colour (0 none, 1 red, 2 green), R, G, B
+    STATUS_RANGE = 0b10,       // ultrasonic distance in cm
+    STATUS_TICKS = 0b100,      // the 8 tick counters, in RESP_TICKS order
+    STATUS_DISTANCE = 0b1000,  // forward and reverse distance in cm
+    STATUS_POSE = 0b10000,     // x, y and heading, as in RESP_POSE
+    STATUS_LINK = 0b100000,    // frames received, bad packets, bad
+                               // checksums, bytes dropped on overrun
+    STATUS_SPEED = 0b1000000   // left and right wheel speed in ticks per
+                               // s, Q8, from encoder edge timing
+} TStatusField;
+
+// Telemetry reports Alex can push on its own.
+// For COMMAND_SUBSCRIBE, param[0] = bitwise OR of these,
+// param[1] = period in ms between pushes, param[2] = TStatusField mask for
+// TELEMETRY_FIELDS
+typedef enum {
+    TELEMETRY_STATUS = 0b01,   // RESP_STATUS: colour and ultrasonic
+    TELEMETRY_TICKS = 0b10,    // RESP_TICKS: encoder ticks and distances
+    TELEMETRY_POSE = 0b100,    // RESP_POSE: dead-reckoned position
+    TELEMETRY_FIELDS = 0b1000  // RESP_FIELDS: the status fields in param[2]
+} TTelemetryType;
+
+// Parameters Alex keeps in EEPROM, with their defaults. Lengths are in
+// 0.1 mm, colour readings in us half periods as in RESP_STATUS.
+typedef enum {
+    PARAM_WHEEL_CIRC = 0,      // Wheel circumference (2042)
+    PARAM_TURN_DIAMETER = 1,   // Circle the wheels follow turning on the
+                               // spot (1709, Alex's diagonal)
+    PARAM_NEAR_CM = 2,         // Obstacle distance that stops a forward
+                               // move, cm (6)
+    PARAM_RED_MAX = 3,         // Red below this and green above
+    PARAM_RED_GREEN_MIN = 4,   // this reads as red (22, 35)
+    PARAM_GREEN_BLUE_MAX = 5,  // Green below red and at most this above
+                               // blue reads as green (8)
+    PARAM_SPEED_KP = 6,        // Wheel speed PID gains in 1/256ths, as for
+    PARAM_SPEED_KI = 7,        // COMMAND_SET_PID (2560, 512, 0)
+    PARAM_SPEED_KD = 8,
+    PARAM_COUNT = 9
+} TParam;
+
+// Tasks the firmware scheduler runs. In RESP_TASKS, params[4 * task] =
+// runs, runs started a whole period or more late, then the last and the
+// longest run time in 0.5 us, saturating at 65535.
+typedef enum {
+    TASK_MOTION = 0,     // Move supervision, every pass
+    TASK_PACKETS = 1,    // Received commands, every pass
+    TASK_COLOUR = 2,     // Colour sampler
+    TASK_TELEMETRY = 3,  // Subscribed reports
+    TASK_COUNT = 4
+} TFirmwareTask;
+
+// Regions timed by the firmware profiler. In RESP_PROFILE,
+// params[4 * region] = calls, then min, average and max CPU cycles.
+typedef enum {
+    PROFILE_LEFT_ISR = 0,        // Left encoder edge
+    PROFILE_USART_RX = 1,        // One received byte
+    PROFILE_HANDLE_COMMAND = 2,  // One command, replies included
+    PROFILE_SEND_STATUS = 3,     // Sensor readout and RESP_STATUS
+    PROFILE_REGIONS = 4
+} TProfileRegion;
 #endif
@@ -8,7 +8,8 @@
 typedef struct {
     char packetType;
     char command;
-    char dummy[2];           // Padding to make up 4 bytes
+    char seq;                // Echoed back by Alex to match replies
+    char credit;             // From Alex: flow control, see RECV_WINDOW
     char data[MAX_STR_LEN];  // String data
     uint32_t params[16];
 } TPacket;
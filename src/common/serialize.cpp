@@ -1,5 +1,5 @@
+#include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
 #include <string.h>
 
 #include "serialize.h"
@@ -17,105 +17,160 @@ typedef struct comms {
     char dummy[3];
 } TComms;
 
-static char _privateBuffer[PACKET_SIZE];
+static_assert(sizeof(TComms) == PACKET_SIZE, "TComms must fill one frame");
 
-static TResult assemble(char* outputBuffer, const char* inputBuffer, int len) {
-    // For copying to output buffer
-    static int counter = 0;
+// MAGIC_NUMBER as it appears on the wire, least significant byte first
+static const unsigned char _magic[4] = {0xFF, 0xFE, 0xFD, 0xFC};
 
-    // If there's leftover bytes from the next transmission
-    static int leftoverFlag = 0;
-    static int leftoverCount = 0;
-    static char leftoverBuffer[PACKET_SIZE];
-
-    int bytesLeft;
-    int i;
+static unsigned char checksumOf(const char* data, size_t size) {
+    unsigned char checksum = 0;
 
-    // Copy in leftovers
-    if (leftoverFlag) {
-        int copyCount;
-        if (leftoverCount <= PACKET_SIZE) {
-            leftoverFlag = 0;
-            copyCount = leftoverCount;
-        } else {
-            copyCount = PACKET_SIZE;
-        }
+    for (size_t i = 0; i < size; i++) {
+        checksum ^= data[i];
+    }
 
-        leftoverCount -= copyCount;
+    return checksum;
+}
 
-        for (i = 0; i < copyCount; i++) {
-            outputBuffer[counter++] = leftoverBuffer[i];
-        }
+// Stop magic bytes in a row, "run" of them before "byte"
+static uint8_t stopRun(uint8_t run, unsigned char byte) {
+    if (byte == (unsigned char)(STOP_MAGIC_FIRST - run)) {
+        return run + 1;
     }
 
-    if (counter + len >= PACKET_SIZE) {
-        bytesLeft = (PACKET_SIZE - counter);
-        leftoverFlag = 1;
-        int bytesToCopy = len - bytesLeft;
+    return byte == STOP_MAGIC_FIRST;
+}
+
+// Take the next byte of a compact frame, magic number already matched: the
+// size, then the data straight into place in the payload, then the checksum
+static TResult compactByte(TFrameParser* parser, unsigned char byte) {
+    TComms* comms = (TComms*)parser->frame.bytes;
+    uint16_t at = parser->count++ - sizeof(_magic);
 
-        // Copy to leftover buffer
-        for (i = 0; i < bytesToCopy; i++) {
-            leftoverBuffer[leftoverCount + i] = inputBuffer[bytesLeft + i];
+    if (at == 0) {
+        if (byte > MAX_DATA_SIZE) {
+            parser->count = 0;
+            return PACKET_BAD;
         }
-        leftoverCount += bytesToCopy;
-    } else {
-        bytesLeft = len;
+        comms->dataSize = byte;
+        return PACKET_INCOMPLETE;
     }
 
-    for (i = 0; i < bytesLeft; i++) {
-        outputBuffer[counter++] = inputBuffer[i];
+    if (at <= comms->dataSize) {
+        comms->buffer[at - 1] = byte;
+        return PACKET_INCOMPLETE;
     }
 
-    if (counter == PACKET_SIZE) {
-        counter = 0;
-        return PACKET_COMPLETE;
-    } else {
-        return PACKET_INCOMPLETE;
+    if (byte != checksumOf(comms->buffer, comms->dataSize)) {
+        parser->count = 0;
+        return PACKET_CHECKSUM_BAD;
     }
+
+    memset(comms->buffer + comms->dataSize, 0,
+           MAX_DATA_SIZE - comms->dataSize);
+
+    // As for a whole frame: start on the next one next call
+    parser->count = PACKET_SIZE;
+    return PACKET_OK;
 }
 
-TResult deserialize(const char* buffer, int len, void* output) {
-    TResult result = assemble(_privateBuffer, buffer, len);
+TResult parseFrame(TFrameParser* parser,
+                   const char* buffer,
+                   int len,
+                   int* used) {
+    TComms* comms = (TComms*)parser->frame.bytes;
+    int i;
 
-    if (result == PACKET_COMPLETE) {
-        // Extract out the comms packet
-        TComms* comms = (TComms*)_privateBuffer;
+    // The last call handed back a whole frame, start on the next one
+    if (parser->count == PACKET_SIZE) {
+        parser->count = 0;
+    }
 
-        // Check that we have a valid packet
-        if (comms->magic != MAGIC_NUMBER) {
-            printf("BAD MAGIC NUMBER. EXPECTED %x GOT %x\n", MAGIC_NUMBER,
-                   comms->magic);
-            return PACKET_BAD;
+    for (i = 0; i < len; i++) {
+        unsigned char byte = buffer[i];
+
+        // Hunt for the magic number, or its compact form. Their bytes are
+        // all different, so on a mismatch the only possible restart is at
+        // this byte.
+        if (parser->count < sizeof(_magic)) {
+            if (byte != _magic[parser->count] &&
+                !(parser->count == sizeof(_magic) - 1 &&
+                  byte == COMPACT_MAGIC_LAST)) {
+                parser->count = 0;
+
+                if (byte != _magic[0]) {
+                    continue;
+                }
+            }
+
+            parser->frame.bytes[parser->count++] = byte;
+            parser->run = 0;
+            continue;
+        }
+
+        // Drop what serialize() stuffed in after three stop magic bytes
+        if (parser->stuffed) {
+            if (parser->run == 3) {
+                parser->run = 0;
+                continue;
+            }
+            parser->run = stopRun(parser->run, byte);
         }
 
-        // Packet is valid. Now let's do the checksum
-        unsigned char checksum = 0;
+        if ((unsigned char)parser->frame.bytes[sizeof(_magic) - 1] ==
+            COMPACT_MAGIC_LAST) {
+            TResult result = compactByte(parser, byte);
+            if (result != PACKET_INCOMPLETE) {
+                *used = i + 1;
+                return result;
+            }
+            continue;
+        }
 
-        unsigned int i;
+        parser->frame.bytes[parser->count++] = byte;
 
-        for (i = 0; i < comms->dataSize; i++) {
-            checksum ^= comms->buffer[i];
+        if (parser->count == offsetof(TComms, buffer) &&
+            comms->dataSize > MAX_DATA_SIZE) {
+            parser->count = 0;
+            *used = i + 1;
+            return PACKET_BAD;
         }
 
-        if (checksum != comms->checksum) {
-            return PACKET_CHECKSUM_BAD;
-        } else {
-            memcpy(output, comms->buffer, comms->dataSize);
+        if (parser->count == PACKET_SIZE) {
+            *used = i + 1;
+
+            if (checksumOf(comms->buffer, comms->dataSize) !=
+                (unsigned char)comms->checksum) {
+                parser->count = 0;
+                return PACKET_CHECKSUM_BAD;
+            }
+
             return PACKET_OK;
         }
-    } else {
-        return result;
     }
+
+    *used = len;
+    return PACKET_INCOMPLETE;
 }
 
-int serialize(char* buffer, void* dataStructure, size_t size) {
-    TComms comms;
+const void* framePayload(const TFrameParser* parser) {
+    return ((const TComms*)parser->frame.bytes)->buffer;
+}
 
-    // We use this to detect for malformed packets
-    comms.magic = MAGIC_NUMBER;
+void* frameData(char* buffer) {
+    return buffer + offsetof(TComms, buffer);
+}
 
-    // Copy over the data structure
-    memcpy(comms.buffer, dataStructure, size);
+int serializeInPlace(char* buffer, size_t size) {
+    // "buffer" may not be aligned for TComms, so the header fields go in
+    // with memcpy.
+    uint32_t magic = MAGIC_NUMBER;
+    uint32_t dataSize = size;
+    char* data = buffer + offsetof(TComms, buffer);
+
+    // We use this to detect for malformed packets
+    memcpy(buffer + offsetof(TComms, magic), &magic, sizeof(magic));
+    memcpy(buffer + offsetof(TComms, dataSize), &dataSize, sizeof(dataSize));
 
     // Now we take a checksum
     unsigned char checksum = 0;
@@ -123,13 +178,57 @@ int serialize(char* buffer, void* dataStructure, size_t size) {
     unsigned i;
 
     for (i = 0; i < size; i++) {
-        checksum ^= comms.buffer[i];
+        checksum ^= data[i];
     }
 
-    comms.checksum = checksum;
-    comms.dataSize = size;
-
-    memcpy(buffer, &comms, sizeof(TComms));
+    buffer[offsetof(TComms, checksum)] = checksum;
 
     return sizeof(TComms);
 }
+
+int serializeCompact(char* buffer, const void* data, size_t size) {
+    char* payload = buffer + sizeof(_magic) + 1;
+
+    // Payload first: it may overlap the header when built in place
+    memmove(payload, data, size);
+    memcpy(buffer, _magic, sizeof(_magic) - 1);
+    buffer[sizeof(_magic) - 1] = (char)COMPACT_MAGIC_LAST;
+    buffer[sizeof(_magic)] = size;
+    payload[size] = checksumOf(payload, size);
+
+    return size + COMPACT_OVERHEAD;
+}
+
+int serializeStop(char* buffer, char seq) {
+    for (int i = 0; i < 4; i++) {
+        buffer[i] = (char)(STOP_MAGIC_FIRST - i);
+    }
+    buffer[4] = seq;
+    buffer[5] = ~seq;
+
+    return STOP_TOKEN_SIZE;
+}
+
+int serialize(char* buffer, void* dataStructure, size_t size) {
+    char frame[PACKET_SIZE];
+
+    // Copy over the data structure
+    memset(frame, 0, sizeof(frame));
+    memcpy(frameData(frame), dataStructure, size);
+    int len = serializeInPlace(frame, size);
+
+    // The magic number is no part of a stop magic run, so the first
+    // stuffed byte is somewhere after it, where the parser looks
+    int out = 0;
+    uint8_t run = 0;
+    for (int i = 0; i < len; i++) {
+        buffer[out++] = frame[i];
+        run = stopRun(run, frame[i]);
+        if (run == 3) {
+            buffer[out++] = FRAME_STUFF_BYTE;
+            run = 0;
+        }
+    }
+
+    return out;
+}
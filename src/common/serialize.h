@@ -1,6 +1,7 @@
 #ifndef __SERIALIZE__
-#define SERIALIZE
+#define __SERIALIZE__
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #define PACKET_SIZE 140
@@ -14,7 +15,122 @@ typedef enum {
     PACKET_COMPLETE = 4
 } TResult;
 
+// Receive side frame assembly. Holds one frame, filled in place as bytes
+// arrive, so a received payload is never copied again. Zero-initialise it
+// before first use, then set "stuffed" to take frames from serialize().
+typedef struct {
+    union {
+        uint32_t align;
+        char bytes[PACKET_SIZE];
+    } frame;
+    uint16_t count;
+    uint8_t stuffed;
+    uint8_t run;  // Stop magic bytes in a row so far, see FRAME_STUFF_BYTE
+} TFrameParser;
+
+// serialize() stuffs its frames so that they never hold a stop token: after
+// the first three stop magic bytes in a row it puts in FRAME_STUFF_BYTE,
+// which a parser with "stuffed" set drops. A frame grows to at most
+// MAX_FRAME_SIZE bytes on the wire.
+#define FRAME_STUFF_BYTE 0
+#define MAX_FRAME_SIZE (PACKET_SIZE + PACKET_SIZE / 3)
+
+// Write a stuffed frame of "size" bytes from "dataStructure" to "buffer",
+// which needs MAX_FRAME_SIZE bytes. Returns the frame length.
 int serialize(char* buffer, void* dataStructure, size_t size);
-TResult deserialize(const char* buffer, int len, void* output);
+
+// Compact frames carry "size" bytes, at most MAX_DATA_SIZE, without the
+// padding: the magic number with COMPACT_MAGIC_LAST as its last byte, a
+// size byte, the data and the checksum. parseFrame() takes both kinds and
+// zero-fills a compact payload out to MAX_DATA_SIZE, so the first few bytes
+// of a structure are enough when the rest is 0, e.g. a TPacket that is only
+// a header.
+#define COMPACT_OVERHEAD 6
+#define COMPACT_MAGIC_LAST 0xFB
+
+// Write a compact frame of "size" bytes from "data" to "buffer", which
+// needs size + COMPACT_OVERHEAD bytes. Returns the frame length. "data" may
+// be frameData(buffer), to send a payload built in place compact.
+int serializeCompact(char* buffer, const void* data, size_t size);
+
+// Where the payload goes in a PACKET_SIZE frame "buffer", so it can be
+// built in place and finished with serializeInPlace() without a copy.
+void* frameData(char* buffer);
+
+// Frame the "size" byte payload already at frameData(buffer). Returns the
+// frame length, like serialize().
+int serializeInPlace(char* buffer, size_t size);
+
+// Feed up to "len" received bytes into "parser", stopping at the end of the
+// first frame. "*used" is set to how many bytes were taken; feed the rest
+// in again. Bytes that cannot start a frame are skipped, so the parser
+// resynchronises on the next magic number after lost or corrupt bytes.
+// Returns:
+//   PACKET_OK            frame is valid, see framePayload()
+//   PACKET_BAD           impossible data size, frame discarded
+//   PACKET_CHECKSUM_BAD  frame discarded
+//   PACKET_INCOMPLETE    all "len" bytes taken, no frame ended
+TResult parseFrame(TFrameParser* parser,
+                   const char* buffer,
+                   int len,
+                   int* used);
+
+// Payload of the frame parseFrame() last returned PACKET_OK for, in place.
+// Valid until the next parseFrame() call on "parser".
+const void* framePayload(const TFrameParser* parser);
+
+// Emergency stop, sent outside the framing so the receiver can spot it
+// byte by byte as it arrives, even in the middle of a frame: four magic
+// bytes counting down from STOP_MAGIC_FIRST, then the sender's seq and its
+// complement. Stuffing keeps the magic out of the frames themselves, so
+// whatever their payload, only a real token matches. It means COMMAND_STOP,
+// and overrides every frame sent before it.
+#define STOP_TOKEN_SIZE 6
+#define STOP_MAGIC_FIRST 0xFB
+
+// Write the stop token for "seq" to "buffer". Returns STOP_TOKEN_SIZE.
+int serializeStop(char* buffer, char seq);
+
+// Receive side stop token detection. Zero-initialise before first use.
+typedef struct {
+    uint8_t count;
+    char seq;
+} TStopMatcher;
+
+// Feed one received byte. Returns 1 when it ends a stop token, whose seq is
+// then in "matcher->seq". Cheap enough for a receive ISR.
+static inline int matchStop(TStopMatcher* matcher, unsigned char byte) {
+    uint8_t count = matcher->count;
+
+    if (count < 4) {
+        if (byte != (unsigned char)(STOP_MAGIC_FIRST - count)) {
+            // The magic bytes are all different, so on a mismatch the only
+            // possible restart is at this byte
+            matcher->count = byte == STOP_MAGIC_FIRST;
+            return 0;
+        }
+    } else if (count == 4) {
+        matcher->seq = byte;
+    } else {
+        matcher->count = byte == STOP_MAGIC_FIRST;
+        if (byte == (unsigned char)~matcher->seq) {
+            matcher->count = 0;
+            return 1;
+        }
+        return 0;
+    }
+
+    matcher->count = count + 1;
+    return 0;
+}
+
+// Credit-based flow control, Pi to Alex. Alex has room for RECV_WINDOW
+// bytes it has not taken out of its receive buffer yet, and the Pi never
+// has more than that outstanding. Every frame from Alex carries, in
+// TPacket::credit, the bytes it has taken since the last PACKET_TYPE_HELLO,
+// modulo 256; a hello starts the count again from 0, and its RESP_OK
+// carries the first count of the new run. The spare room past the window
+// always fits a stop token, which may be sent without credit.
+#define RECV_WINDOW 249
 
 #endif
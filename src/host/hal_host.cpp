@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include "hal.h"
+#include "host.h"
+#include "world.h"
+
+#define HOST_PINS 14
+
+// ATmega328P EEPROM size, erased to 0xFF
+#define HOST_EEPROM_SIZE 1024
+
+// Ticks more than this far behind are dropped rather than caught up on,
+// e.g. after the process was stopped in a debugger
+#define HOST_MAX_TICK_LAG_US 100000
+
+// With ALEX_HOST_SPEED=0, how long the firmware may keep running, in real
+// time, before simulated time moves on without it going to sleep
+#define HOST_MAX_BUSY_US 1000
+
+// The CPU: held by whoever runs with interrupts disabled, i.e. the
+// firmware inside a critical section or the interrupt thread inside a
+// handler
+static std::mutex _cpu;
+static std::condition_variable_any _interrupted;
+static thread_local uint8_t _irqOff = 0;
+
+// Simulated time runs "_speed" times real time, or with 0, jumps to the
+// next event whenever the firmware sleeps: "_idle" says it went to sleep
+// with nothing delivered since, and "_virtualUs" is the time
+static uint64_t _startUs;
+static uint32_t _speed = 1;
+static std::atomic<uint64_t> _virtualUs(0);
+static std::atomic<uint8_t> _idle(0);
+static std::condition_variable_any _sleeping;
+
+static std::atomic<int> _pwm[HOST_PINS];
+static std::atomic<uint8_t> _pins[HOST_PINS];
+static std::atomic<uint8_t> _timer0On(1);
+
+static std::atomic<uint8_t> _tickOn(0);
+static std::atomic<uint8_t> _extIntOn(0);
+
+// UART. _txActive only changes with the CPU held, see halUartStartTx().
+static int _master = -1;
+static int _slave = -1;
+static int _wake[2] = {-1, -1};
+static std::atomic<uint32_t> _byteUs(0);
+static std::atomic<uint8_t> _txActive(0);
+
+// EEPROM contents, kept in the ALEX_HOST_EEPROM file if there is one
+static uint8_t _eeprom[HOST_EEPROM_SIZE];
+static const char* _eepromPath = NULL;
+
+// Bytes from hostUartInject(), received ahead of the PTY's
+static std::mutex _injectLock;
+static std::deque<uint8_t> _injected;
+
+static uint64_t monotonicUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t hostMicros() {
+    if (_speed == 0) {
+        return _virtualUs;
+    }
+
+    return (monotonicUs() - _startUs) * _speed;
+}
+
+void hostInterrupt(void (*isr)(void)) {
+    // Already in a handler, or a critical section, on this thread
+    if (_irqOff) {
+        _idle = 0;
+        isr();
+        return;
+    }
+
+    _cpu.lock();
+    _irqOff = 1;
+    _idle = 0;
+    isr();
+    _irqOff = 0;
+    _cpu.unlock();
+
+    _interrupted.notify_all();
+}
+
+// What a PWM pin puts out, nothing while its timer is not clocked
+int hostPwm(uint8_t pin) {
+    if (pin >= HOST_PINS || ((pin == 5 || pin == 6) && !_timer0On)) {
+        return 0;
+    }
+
+    return _pwm[pin];
+}
+
+uint8_t hostPin(uint8_t pin) {
+    return pin < HOST_PINS ? _pins[pin].load() : 0;
+}
+
+static void wakeInterruptThread() {
+    char one = 1;
+    if (write(_wake[1], &one, 1) < 0) {
+        // Already full, it will wake anyway
+    }
+}
+
+static void openUart() {
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (_master < 0 || grantpt(_master) < 0 || unlockpt(_master) < 0) {
+        perror("alex-host: posix_openpt");
+        exit(1);
+    }
+
+    // Hold the other end open ourselves, raw, so that bytes sent before a
+    // client connects are neither echoed back nor turned into EIO
+    const char* name = ptsname(_master);
+    _slave = open(name, O_RDWR | O_NOCTTY);
+    if (_slave < 0) {
+        perror("alex-host: open pty");
+        exit(1);
+    }
+
+    struct termios raw;
+    tcgetattr(_slave, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(_slave, TCSANOW, &raw);
+
+    // Like a real wire, a full PTY loses bytes instead of stalling us
+    fcntl(_master, F_SETFL, fcntl(_master, F_GETFL) | O_NONBLOCK);
+
+    fprintf(stderr, "alex-host: UART on %s\n", name);
+
+    const char* link = getenv("ALEX_HOST_PORT");
+    if (link) {
+        unlink(link);
+        if (symlink(name, link) < 0) {
+            perror("alex-host: symlink");
+            exit(1);
+        }
+        fprintf(stderr, "alex-host: UART also on %s\n", link);
+    }
+}
+
+void hostEncoderEdge(uint8_t wheel) {
+    if (_extIntOn) {
+        hostInterrupt(wheel == 0 ? halExtInt0Handler : halExtInt1Handler);
+    }
+}
+
+void hostUartInject(const void* data, int len) {
+    {
+        std::lock_guard<std::mutex> lock(_injectLock);
+        _injected.insert(_injected.end(), (const uint8_t*)data,
+                         (const uint8_t*)data + len);
+    }
+
+    wakeInterruptThread();
+}
+
+static void tick() {
+    if (_tickOn) {
+        hostInterrupt(halTickHandler);
+    }
+
+    // Encoders and sensors
+    worldTick();
+}
+
+// Up to "size" bytes for the receiver: injected ones first, then the PTY's
+static int receiveBytes(unsigned char* buffer, int size) {
+    {
+        std::lock_guard<std::mutex> lock(_injectLock);
+        int len = 0;
+        while (len < size && !_injected.empty()) {
+            buffer[len++] = _injected.front();
+            _injected.pop_front();
+        }
+        if (len > 0) {
+            return len;
+        }
+    }
+
+    ssize_t got = read(_master, buffer, size);
+    return got > 0 ? got : 0;
+}
+
+// With ALEX_HOST_SPEED=0: give the firmware the CPU until it has dealt
+// with everything delivered so far and gone back to sleep
+static void waitForIdle() {
+    std::unique_lock<std::mutex> lock(_cpu);
+    _sleeping.wait_for(lock, std::chrono::microseconds(HOST_MAX_BUSY_US),
+                       [] { return _idle.load() != 0; });
+}
+
+// Next byte from the firmware, or -1 once it has none left
+static int16_t transmitInterrupt() {
+    _cpu.lock();
+    _irqOff = 1;
+    _idle = 0;
+
+    int16_t next = halUartTxHandler();
+    if (next < 0) {
+        _txActive = 0;
+    }
+
+    _irqOff = 0;
+    _cpu.unlock();
+    _interrupted.notify_all();
+
+    return next;
+}
+
+static void receiveInterrupt(uint8_t data) {
+    _cpu.lock();
+    _irqOff = 1;
+    _idle = 0;
+    halUartRxHandler(data);
+    _irqOff = 0;
+    _cpu.unlock();
+
+    _interrupted.notify_all();
+}
+
+// The MCU's peripherals. Sleeps until the next tick, or byte time while
+// the UART has something to do.
+static void interruptThread() {
+    uint64_t nextTick = hostMicros() + 1000;
+    uint64_t nextRx = 0;
+    uint64_t nextTx = 0;
+
+    unsigned char rx[64];
+    int rxLen = 0;
+    int rxPos = 0;
+
+    for (;;) {
+        uint64_t now = hostMicros();
+        uint32_t byteUs = _byteUs;
+
+        if (now > nextTick + HOST_MAX_TICK_LAG_US) {
+            nextTick = now;
+        }
+        while (now >= nextTick) {
+            tick();
+            nextTick += 1000;
+        }
+
+        // One receive interrupt per byte time
+        while (rxPos < rxLen && now >= nextRx) {
+            receiveInterrupt(rx[rxPos++]);
+            nextRx += byteUs;
+        }
+        if (rxPos == rxLen && byteUs) {
+            int got = receiveBytes(rx, sizeof(rx));
+            if (got > 0) {
+                rxLen = got;
+                rxPos = 0;
+                if (nextRx < now) {
+                    nextRx = now;
+                }
+                continue;
+            }
+        }
+
+        // And one transmit interrupt per byte time while there is data
+        bool sending = _txActive;
+        if (sending) {
+            unsigned char tx[64];
+            int txLen = 0;
+
+            if (nextTx < now) {
+                nextTx = now;
+            }
+            while (now >= nextTx && txLen < (int)sizeof(tx)) {
+                int16_t next = transmitInterrupt();
+                if (next < 0) {
+                    sending = false;
+                    break;
+                }
+                tx[txLen++] = next;
+                nextTx += byteUs;
+            }
+
+            if (txLen > 0 && write(_master, tx, txLen) < 0 &&
+                errno != EAGAIN) {
+                perror("alex-host: write");
+            }
+        }
+
+        // Sleep until whatever comes first
+        uint64_t until = nextTick;
+        if (rxPos < rxLen && nextRx < until) {
+            until = nextRx;
+        }
+        if (sending && nextTx < until) {
+            until = nextTx;
+        }
+
+        // Skip straight there once the firmware is asleep. Input from the
+        // PTY still comes in as it arrives, at the next time step.
+        if (_speed == 0) {
+            waitForIdle();
+            if (until > _virtualUs) {
+                _virtualUs = until;
+            }
+            continue;
+        }
+
+        now = hostMicros();
+        uint64_t waitUs = until > now ? (until - now) / _speed : 0;
+        struct timespec timeout = {(time_t)(waitUs / 1000000),
+                                   (long)(waitUs % 1000000) * 1000};
+
+        // Only look for more input once the last lot is delivered, and the
+        // UART is set up
+        bool canRead = rxPos == rxLen && byteUs;
+        struct pollfd fds[2] = {{canRead ? _master : -1, POLLIN, 0},
+                                {_wake[0], POLLIN, 0}};
+        if (ppoll(fds, 2, &timeout, NULL) > 0 && (fds[1].revents & POLLIN)) {
+            char drain[16];
+            while (read(_wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+    }
+}
+
+static void loadEeprom() {
+    memset(_eeprom, 0xFF, sizeof(_eeprom));
+
+    _eepromPath = getenv("ALEX_HOST_EEPROM");
+    if (!_eepromPath) {
+        return;
+    }
+
+    // A missing or short file reads as erased
+    FILE* file = fopen(_eepromPath, "rb");
+    if (file) {
+        if (fread(_eeprom, 1, sizeof(_eeprom), file) == 0) {
+            memset(_eeprom, 0xFF, sizeof(_eeprom));
+        }
+        fclose(file);
+    }
+}
+
+void halSetup() {
+    _startUs = monotonicUs();
+    loadEeprom();
+
+    const char* speed = getenv("ALEX_HOST_SPEED");
+    if (speed) {
+        _speed = atol(speed);
+    }
+
+    // Interrupts start off disabled, as after reset
+    halIrqDisable();
+
+    if (pipe(_wake) < 0) {
+        perror("alex-host: pipe");
+        exit(1);
+    }
+    fcntl(_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(_wake[1], F_SETFL, O_NONBLOCK);
+
+    openUart();
+    setupWorld();
+
+    std::thread(interruptThread).detach();
+}
+
+uint8_t halIrqSave() {
+    if (_irqOff) {
+        return 0;
+    }
+
+    _cpu.lock();
+    _irqOff = 1;
+
+    return 1;
+}
+
+void halIrqRestore(uint8_t state) {
+    if (state) {
+        halIrqEnable();
+    }
+}
+
+void halIrqDisable() {
+    if (!_irqOff) {
+        _cpu.lock();
+        _irqOff = 1;
+    }
+}
+
+void halIrqEnable() {
+    if (_irqOff) {
+        _irqOff = 0;
+        _cpu.unlock();
+    }
+}
+
+void halSleep() {
+    // Gives up the CPU and takes it back atomically, so no interrupt can
+    // slip in between the caller's check and going to sleep
+    _idle = 1;
+    _sleeping.notify_all();
+    _interrupted.wait(_cpu);
+    halIrqEnable();
+}
+
+void halPowerSaving() {
+}
+
+void halPinOutput(uint8_t pin) {
+    (void)pin;
+}
+
+void halPinInputPullup(uint8_t pin) {
+    if (pin < HOST_PINS) {
+        _pins[pin] = 1;
+    }
+}
+
+void halPinWrite(uint8_t pin, uint8_t high) {
+    if (pin < HOST_PINS) {
+        _pins[pin] = high ? 1 : 0;
+    }
+}
+
+void halPwmSetup() {
+    for (int i = 0; i < HOST_PINS; i++) {
+        _pwm[i] = 0;
+    }
+}
+
+void halPwmWrite(uint8_t pin, int val) {
+    if (pin < HOST_PINS) {
+        _pwm[pin] = val <= 0 ? 0 : val > 255 ? 255 : val;
+    }
+}
+
+void halPwmPower(uint8_t on) {
+    _timer0On = on;
+}
+
+void halUartSetup(uint32_t baud) {
+    const char* override = getenv("ALEX_HOST_BAUD");
+    if (override && atol(override) > 0) {
+        baud = atol(override);
+    }
+
+    // 10 bits a byte with the start and stop bits, at least 1 us apart
+    uint32_t byteUs = 10000000 / baud;
+    _byteUs = byteUs ? byteUs : 1;
+
+    wakeInterruptThread();
+}
+
+void halUartStartTx() {
+    // Under the CPU lock, so this cannot cross with the interrupt thread
+    // finding the queue empty and stopping
+    uint8_t state = halIrqSave();
+    _txActive = 1;
+    halIrqRestore(state);
+
+    wakeInterruptThread();
+}
+
+void halTickSetup() {
+    _tickOn = 1;
+}
+
+void halExtIntSetup() {
+    _extIntOn = 1;
+}
+
+void halEepromRead(uint16_t addr, void* data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        ((uint8_t*)data)[i] = _eeprom[(addr + i) % HOST_EEPROM_SIZE];
+    }
+}
+
+void halEepromWrite(uint16_t addr, const void* data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        _eeprom[(addr + i) % HOST_EEPROM_SIZE] = ((const uint8_t*)data)[i];
+    }
+
+    if (!_eepromPath) {
+        return;
+    }
+
+    FILE* file = fopen(_eepromPath, "wb");
+    if (!file || fwrite(_eeprom, 1, sizeof(_eeprom), file) != sizeof(_eeprom)) {
+        perror("alex-host: EEPROM");
+    }
+    if (file) {
+        fclose(file);
+    }
+}
+
+void halDelayMs(uint16_t ms) {
+    // Interrupts still run: a sleep on this thread does not hold the CPU
+    uint64_t until = hostMicros() + (uint64_t)ms * 1000;
+    while (hostMicros() < until) {
+        usleep(100);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdint.h>
+
+/*
+ *  Host build of the firmware: alex.cpp and its portable modules, with
+ *  hal.h implemented on Linux by hal_host.cpp and stand-ins for the
+ *  sensor modules in sensors_host.cpp.
+ *
+ *  One "interrupt" thread plays the MCU's peripherals: it delivers the
+ *  1 ms tick, received bytes and UART transmit requests at the configured
+ *  baud rate, and encoder edges, each as a handler call made while holding
+ *  the lock that halIrqSave() and friends take. Interrupts are therefore
+ *  atomic with respect to the firmware's critical sections, as on the AVR.
+ *
+ *  Environment:
+ *      ALEX_HOST_PORT  Also make the UART's PTY reachable at this path
+ *      ALEX_HOST_BAUD  Pace the UART at this rate instead of the firmware's
+ *                      own, e.g. much higher to benchmark at full speed
+ *      ALEX_HOST_SPEED Run simulated time this many times faster than real
+ *                      time, or with 0, as fast as the firmware keeps up:
+ *                      time skips ahead to the next event whenever it sleeps
+ *      ALEX_HOST_WORLD Simulate the robot in the arena this file describes,
+ *                      and play its script, see world.h
+ *      ALEX_HOST_TRACE Write the simulated robot's path to this CSV file
+ *      ALEX_HOST_EEPROM
+ *                      Keep the EEPROM in this file, so saved parameters
+ *                      survive a restart
+ *
+ *  The functions below let simulations and tests drive the sensors and
+ *  watch the motors.
+ */
+
+// Simulated microseconds since halSetup()
+uint64_t hostMicros();
+
+// Run "isr" as an interrupt handler, as soon as interrupts are enabled
+void hostInterrupt(void (*isr)(void));
+
+// Duty cycle a PWM pin puts out, 0 to 255
+int hostPwm(uint8_t pin);
+
+// Level last written to a GPIO pin
+uint8_t hostPin(uint8_t pin);
+
+// Falling edge on wheel 0 (left, INT0) or 1 (right, INT1)'s encoder, if
+// the firmware has set up external interrupts
+void hostEncoderEdge(uint8_t wheel);
+
+// Bytes for the firmware's UART to receive, ahead of any from the PTY
+void hostUartInject(const void* data, int len);
+
+// What the ultrasonic sensor reads with nothing in range
+#define HOST_RANGE_NONE_CM 564
+
+// Distance the ultrasonic sensor reads, in cm. Calls the near handler, as
+// an interrupt, if it is within the near distance, see setUltrasonicNear().
+void hostSetRange(int cm);
+
+// Colour sample the sampler reports from now on, in us half periods
+void hostSetColour(uint16_t red, uint16_t green, uint16_t blue);
+
+#endif /* HOST_H_ */
@@ -0,0 +1,81 @@
+// Stand-ins for the modules that sit on dedicated AVR timer and capture
+// hardware: hrclock, colour and ultrasonic. Readings come from host.h.
+
+#include <atomic>
+#include "colour.h"
+#include "hal.h"
+#include "host.h"
+#include "hrclock.h"
+#include "ultrasonic.h"
+
+static std::atomic<int> _range(HOST_RANGE_NONE_CM);
+static void (*_onNear)(void) = 0;
+static std::atomic<int> _nearCm(ULTRASONIC_NEAR_CM);
+
+static TColourSample _colour;
+static std::atomic<uint8_t> _haveColour(0);
+
+void setupHrClock() {
+}
+
+uint32_t hrClockNow() {
+    return (uint32_t)(hostMicros() * HRCLOCK_TICKS_PER_US);
+}
+
+uint32_t hrClockExtend(uint8_t count) {
+    (void)count;
+
+    return hrClockNow();
+}
+
+void setupColourSampler() {
+}
+
+void serviceColourSampler() {
+}
+
+int readColourSample(TColourSample* sample) {
+    if (!_haveColour) {
+        return 0;
+    }
+
+    uint8_t state = halIrqSave();
+    *sample = _colour;
+    halIrqRestore(state);
+
+    return 1;
+}
+
+void hostSetColour(uint16_t red, uint16_t green, uint16_t blue) {
+    uint8_t state = halIrqSave();
+    _colour.red = red;
+    _colour.green = green;
+    _colour.blue = blue;
+    halIrqRestore(state);
+
+    _haveColour = 1;
+}
+
+void setupUltrasonic(void (*onNear)(void)) {
+    _onNear = onNear;
+}
+
+int ultrasonicDistance() {
+    return _range;
+}
+
+int ultrasonicNear() {
+    return _range <= _nearCm;
+}
+
+void setUltrasonicNear(uint8_t cm) {
+    _nearCm = cm;
+}
+
+void hostSetRange(int cm) {
+    _range = cm;
+
+    if (cm <= _nearCm && _onNear) {
+        hostInterrupt(_onNear);
+    }
+}
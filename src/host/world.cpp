@@ -0,0 +1,480 @@
+#include "world.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <random>
+#include <vector>
+#include "constants.h"
+#include "host.h"
+#include "packet.h"
+#include "serialize.h"
+
+// The robot, as the firmware's default parameters have it:
+// PARAM_WHEEL_CIRC / COUNTS_PER_REV, its size, and the diagonal that it
+// turns on (PARAM_TURN_DIAMETER)
+#define WORLD_CM_PER_TICK (20.42 / 200)
+#define WORLD_LENGTH_CM 16
+#define WORLD_BREADTH_CM 6
+#define WORLD_TRACK_CM 17.09
+
+// Wheel speed at 100% duty, in encoder ticks per second
+// (WHEEL_MAX_TICKS_PER_S in alex.cpp)
+#define WORLD_MAX_TICKS_PER_S 600
+
+// Motor pins of each wheel, forward and reverse, see alex.cpp
+#define WORLD_LEFT_PINS 5, 6
+#define WORLD_RIGHT_PINS 10, 9
+
+// Both sensors sit at the front. The ultrasonic pings every
+// WORLD_PING_MS, its beam WORLD_BEAM_DEG either side of straight ahead.
+#define WORLD_SENSOR_AHEAD_CM (WORLD_LENGTH_CM / 2)
+#define WORLD_PING_MS 60
+#define WORLD_BEAM_DEG 7.5
+#define WORLD_RANGE_MAX_CM 400
+#define WORLD_COLOUR_MS 10
+
+typedef struct {
+    double x0, y0, x1, y1;
+} TRect;
+
+typedef struct {
+    TRect area;
+    uint16_t red, green, blue;
+} TPatch;
+
+typedef struct {
+    uint32_t ms;
+    uint8_t end;
+    uint8_t estop;  // Send a stop token with packet.seq instead of a frame
+    TPacket packet;
+} TEvent;
+
+typedef struct {
+    // Motor pins, forward and reverse
+    uint8_t forwardPin;
+    uint8_t reversePin;
+
+    double slip;
+
+    // Ticks per second, and turned so far towards the next edge
+    double speed;
+    double edgeCredit;
+    uint32_t ticks;
+} TWheel;
+
+// Everything below is only touched by the interrupt thread, after set-up
+static TWheel _wheels[2] = {{WORLD_LEFT_PINS, 0, 0, 0, 0},
+                            {WORLD_RIGHT_PINS, 0, 0, 0, 0}};
+
+static double _x = 0;
+static double _y = 0;
+static double _heading = 0;  // In radians
+static double _travelled = 0;
+
+static double _track = WORLD_TRACK_CM;
+static double _maxTicksPerS = WORLD_MAX_TICKS_PER_S;
+static double _tauMs = 0;
+static double _deadband = 0;
+static double _slipNoise = 0;
+static std::mt19937 _random(1);
+
+static std::vector<TRect> _walls;
+static std::vector<TPatch> _patches;
+static TPatch _floor;
+static uint8_t _haveFloor = 0;
+
+// Sensors are only driven when there is a world file
+static uint8_t _sensing = 0;
+static int _range = HOST_RANGE_NONE_CM;
+static const TPatch* _under = NULL;
+
+static std::vector<TEvent> _script;
+static size_t _nextEvent = 0;
+
+static uint32_t _ms = 0;
+static uint32_t _collisions = 0;
+static uint8_t _colliding = 0;
+static uint64_t _startRealUs;
+
+static FILE* _trace = NULL;
+
+static uint64_t realUs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static double radians(double degrees) {
+    return degrees * M_PI / 180;
+}
+
+static double degrees(double radians) {
+    return radians * 180 / M_PI;
+}
+
+// Rectangles may be given by any two opposite corners
+static TRect makeRect(double x0, double y0, double x1, double y1) {
+    return {fmin(x0, x1), fmin(y0, y1), fmax(x0, x1), fmax(y0, y1)};
+}
+
+static int commandType(const char* name) {
+    static const struct {
+        const char* name;
+        TCommandType type;
+    } commands[] = {
+        {"forward", COMMAND_FORWARD},
+        {"reverse", COMMAND_REVERSE},
+        {"left", COMMAND_TURN_LEFT},
+        {"right", COMMAND_TURN_RIGHT},
+        {"stop", COMMAND_STOP},
+        {"stats", COMMAND_GET_STATS},
+        {"clear", COMMAND_CLEAR_STATS},
+        {"subscribe", COMMAND_SUBSCRIBE},
+        {"unsubscribe", COMMAND_UNSUBSCRIBE},
+        {"pid", COMMAND_SET_PID},
+        {"pose", COMMAND_GET_POSE},
+        {"params", COMMAND_GET_PARAMS},
+        {"setparam", COMMAND_SET_PARAM},
+        {"saveparams", COMMAND_SAVE_PARAMS},
+        {"fields", COMMAND_GET_FIELDS},
+        {"tasks", COMMAND_GET_TASKS},
+    };
+
+    for (const auto& command : commands) {
+        if (strcmp(command.name, name) == 0) {
+            return command.type;
+        }
+    }
+
+    return (name[0] >= '0' && name[0] <= '9') ? atoi(name) : -1;
+}
+
+static void badLine(const char* path, int lineNo, const char* why) {
+    fprintf(stderr, "alex-host: %s:%d: %s\n", path, lineNo, why);
+    exit(1);
+}
+
+static void readWorld(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+
+    char line[256];
+    int lineNo = 0;
+    uint8_t seq = 1;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNo++;
+
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = 0;
+        }
+
+        char* words[24];
+        int count = 0;
+        for (char* word = strtok(line, " \t\r\n"); word && count < 24;
+             word = strtok(NULL, " \t\r\n")) {
+            words[count++] = word;
+        }
+        if (count == 0) {
+            continue;
+        }
+
+        double arg[8] = {0};
+        for (int i = 1; i < count && i <= 8; i++) {
+            arg[i - 1] = atof(words[i]);
+        }
+
+        const char* item = words[0];
+        if (strcmp(item, "robot") == 0 && count == 4) {
+            _x = arg[0];
+            _y = arg[1];
+            _heading = radians(arg[2]);
+        } else if (strcmp(item, "track") == 0 && count == 2 && arg[0] > 0) {
+            _track = arg[0];
+        } else if (strcmp(item, "motor") == 0 && count == 4 &&
+                   arg[2] < 255) {
+            _maxTicksPerS = arg[0];
+            _tauMs = arg[1];
+            _deadband = arg[2];
+        } else if (strcmp(item, "slip") == 0 && count == 5) {
+            _wheels[0].slip = arg[0];
+            _wheels[1].slip = arg[1];
+            _slipNoise = arg[2];
+            _random.seed((uint32_t)arg[3]);
+        } else if (strcmp(item, "wall") == 0 && count == 5) {
+            _walls.push_back(makeRect(arg[0], arg[1], arg[2], arg[3]));
+        } else if (strcmp(item, "patch") == 0 && count == 8) {
+            _patches.push_back({makeRect(arg[0], arg[1], arg[2], arg[3]),
+                                (uint16_t)arg[4], (uint16_t)arg[5],
+                                (uint16_t)arg[6]});
+        } else if (strcmp(item, "floor") == 0 && count == 4) {
+            _floor = {{0, 0, 0, 0},
+                      (uint16_t)arg[0],
+                      (uint16_t)arg[1],
+                      (uint16_t)arg[2]};
+            _haveFloor = 1;
+        } else if (item[0] >= '0' && item[0] <= '9' && count >= 2) {
+            TEvent event;
+            memset(&event, 0, sizeof(event));
+            event.ms = atol(item);
+
+            if (!_script.empty() && event.ms < _script.back().ms) {
+                badLine(path, lineNo, "script out of time order");
+            }
+
+            if (strcmp(words[1], "end") == 0) {
+                event.end = 1;
+            } else if (strcmp(words[1], "estop") == 0) {
+                event.estop = 1;
+                event.packet.seq = seq++;
+            } else if (strcmp(words[1], "command") == 0 && count >= 3) {
+                int type = commandType(words[2]);
+                if (type < 0) {
+                    badLine(path, lineNo, "unknown command");
+                }
+
+                event.packet.packetType = PACKET_TYPE_COMMAND;
+                event.packet.command = type;
+                event.packet.seq = seq++;
+                for (int i = 3; i < count && i - 3 < 16; i++) {
+                    event.packet.params[i - 3] = strtoul(words[i], NULL, 0);
+                }
+            } else {
+                badLine(path, lineNo, "bad event");
+            }
+
+            _script.push_back(event);
+        } else {
+            badLine(path, lineNo, "bad item");
+        }
+    }
+
+    fclose(file);
+}
+
+void setupWorld() {
+    _startRealUs = realUs();
+
+    const char* path = getenv("ALEX_HOST_WORLD");
+    if (path) {
+        readWorld(path);
+        _sensing = 1;
+    }
+
+    const char* trace = getenv("ALEX_HOST_TRACE");
+    if (trace) {
+        _trace = fopen(trace, "w");
+        if (!_trace) {
+            perror(trace);
+            exit(1);
+        }
+        fprintf(_trace,
+                "ms,x,y,heading,left_ticks,right_ticks,range,red,green,"
+                "blue\n");
+    }
+}
+
+// Distance along the ray from (x, y) at "angle" to the rectangle, or -1 if
+// it misses
+static double rayHits(double x, double y, double angle, const TRect* rect) {
+    double dx = cos(angle);
+    double dy = sin(angle);
+    double near = 0;
+    double far = INFINITY;
+
+    // Slabs: where the ray is between each pair of sides
+    double from[2] = {x, y};
+    double step[2] = {dx, dy};
+    double lo[2] = {rect->x0, rect->y0};
+    double hi[2] = {rect->x1, rect->y1};
+
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabs(step[axis]) < 1e-12) {
+            if (from[axis] < lo[axis] || from[axis] > hi[axis]) {
+                return -1;
+            }
+            continue;
+        }
+
+        double t0 = (lo[axis] - from[axis]) / step[axis];
+        double t1 = (hi[axis] - from[axis]) / step[axis];
+        near = fmax(near, fmin(t0, t1));
+        far = fmin(far, fmax(t0, t1));
+    }
+
+    return near <= far ? near : -1;
+}
+
+static int touchesWall(double x, double y, double radius) {
+    for (const TRect& wall : _walls) {
+        double dx = x - fmax(wall.x0, fmin(x, wall.x1));
+        double dy = y - fmax(wall.y0, fmin(y, wall.y1));
+        if (dx * dx + dy * dy < radius * radius) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void ping() {
+    double x = _x + WORLD_SENSOR_AHEAD_CM * cos(_heading);
+    double y = _y + WORLD_SENSOR_AHEAD_CM * sin(_heading);
+    double nearest = WORLD_RANGE_MAX_CM;
+
+    for (double off = -WORLD_BEAM_DEG; off <= WORLD_BEAM_DEG;
+         off += WORLD_BEAM_DEG) {
+        for (const TRect& wall : _walls) {
+            double hit = rayHits(x, y, _heading + radians(off), &wall);
+            if (hit >= 0 && hit < nearest) {
+                nearest = hit;
+            }
+        }
+    }
+
+    _range = nearest < WORLD_RANGE_MAX_CM ? (int)nearest : HOST_RANGE_NONE_CM;
+    hostSetRange(_range);
+}
+
+static void sampleColour() {
+    double x = _x + WORLD_SENSOR_AHEAD_CM * cos(_heading);
+    double y = _y + WORLD_SENSOR_AHEAD_CM * sin(_heading);
+
+    _under = _haveFloor ? &_floor : NULL;
+    for (const TPatch& patch : _patches) {
+        if (x >= patch.area.x0 && x <= patch.area.x1 && y >= patch.area.y0 &&
+            y <= patch.area.y1) {
+            _under = &patch;
+        }
+    }
+
+    if (_under) {
+        hostSetColour(_under->red, _under->green, _under->blue);
+    }
+}
+
+// Turn the wheel for a millisecond and put out its encoder edges. Returns
+// how far it moved the ground under it, in cm.
+static double turnWheel(uint8_t index) {
+    TWheel* wheel = &_wheels[index];
+
+    double duty = hostPwm(wheel->forwardPin) - hostPwm(wheel->reversePin);
+    double drive = fmax(fabs(duty) - _deadband, 0) / (255 - _deadband);
+    double target = copysign(drive * _maxTicksPerS, duty);
+
+    if (_tauMs > 1) {
+        wheel->speed += (target - wheel->speed) / _tauMs;
+    } else {
+        wheel->speed = target;
+    }
+
+    // The encoder has one channel: edges come either way round
+    double turned = wheel->speed / 1000;
+    wheel->edgeCredit += fabs(turned);
+    while (wheel->edgeCredit >= 1) {
+        wheel->edgeCredit -= 1;
+        wheel->ticks++;
+        hostEncoderEdge(index);
+    }
+
+    double slip = wheel->slip;
+    if (_slipNoise > 0) {
+        slip += std::normal_distribution<double>(0, _slipNoise)(_random);
+    }
+
+    return turned * WORLD_CM_PER_TICK * (1 - fmin(fmax(slip, 0), 1));
+}
+
+static void move(double left, double right) {
+    double forward = (left + right) / 2;
+    double heading = _heading + (right - left) / _track;
+    double x = _x + forward * cos((_heading + heading) / 2);
+    double y = _y + forward * sin((_heading + heading) / 2);
+
+    // Into a wall, the wheels just spin
+    double radius = hypot(WORLD_LENGTH_CM, WORLD_BREADTH_CM) / 2;
+    if (touchesWall(x, y, radius)) {
+        if (!_colliding) {
+            _collisions++;
+            fprintf(stderr, "alex-host: hit a wall at %u ms, (%.1f, %.1f)\n",
+                    _ms, _x, _y);
+        }
+        _colliding = 1;
+        return;
+    }
+
+    _colliding = 0;
+    _travelled += fabs(forward);
+    _x = x;
+    _y = y;
+    _heading = heading;
+}
+
+static void writeTrace() {
+    fprintf(_trace, "%u,%.2f,%.2f,%.2f,%u,%u,%d,%d,%d,%d\n", _ms, _x, _y,
+            degrees(_heading), _wheels[0].ticks, _wheels[1].ticks,
+            _sensing ? _range : -1, _under ? _under->red : -1,
+            _under ? _under->green : -1, _under ? _under->blue : -1);
+}
+
+static void finish() {
+    double realS = (realUs() - _startRealUs) / 1e6;
+
+    printf("Simulated %u ms in %.2f s (%.0fx real time)\n", _ms, realS,
+           realS > 0 ? _ms / 1000.0 / realS : 0);
+    printf("Pose: x %.2f y %.2f cm, heading %.2f deg\n", _x, _y,
+           degrees(_heading));
+    printf("Travelled %.2f cm, encoder ticks left %u right %u\n", _travelled,
+           _wheels[0].ticks, _wheels[1].ticks);
+    printf("Collisions: %u\n", _collisions);
+    fflush(stdout);
+
+    if (_trace) {
+        fclose(_trace);
+    }
+
+    // Straight out: the firmware thread is still running
+    _exit(0);
+}
+
+void worldTick() {
+    _ms++;
+
+    while (_nextEvent < _script.size() && _script[_nextEvent].ms <= _ms) {
+        TEvent* event = &_script[_nextEvent++];
+        if (event->end) {
+            finish();
+        }
+
+        char frame[MAX_FRAME_SIZE];
+        int len = event->estop
+                      ? serializeStop(frame, event->packet.seq)
+                      : serialize(frame, &event->packet, sizeof(event->packet));
+        hostUartInject(frame, len);
+    }
+
+    double left = turnWheel(0);
+    double right = turnWheel(1);
+    move(left, right);
+
+    if (_sensing) {
+        if (_ms % WORLD_PING_MS == 0) {
+            ping();
+        }
+        if (_ms % WORLD_COLOUR_MS == 0) {
+            sampleColour();
+        }
+    }
+
+    if (_trace && _ms % WORLD_TRACE_MS == 0) {
+        writeTrace();
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef WORLD_H_
+#define WORLD_H_
+
+/*
+ *  2-D differential drive simulation of the robot in an arena, for the
+ *  host build. Every millisecond worldTick() turns the motor PWM into wheel
+ *  speeds, through a deadband and a first order lag, moves the robot with
+ *  some wheel slip, and feeds the encoders, ultrasonic and colour sensor.
+ *
+ *  Without ALEX_HOST_WORLD the arena is empty, the motors ideal and the
+ *  wheels do not slip, and only the encoders are driven.
+ *
+ *  A world file has one item a line, "#" starts a comment. Distances are in
+ *  cm, angles in degrees anticlockwise, and x points along heading 0.
+ *  Set-up, defaults in brackets:
+ *      robot X Y HEADING        start pose (0 0 0)
+ *      track CM                 effective distance between the left and
+ *                               right wheels when turning (17.1, what
+ *                               the firmware assumes by default)
+ *      motor TICKS_PER_S TAU_MS DEADBAND
+ *                               wheel speed at full duty (600), time
+ *                               constant of the response (0), and duty
+ *                               that does not yet turn the wheel (0)
+ *      slip LEFT RIGHT NOISE SEED
+ *                               fraction of each wheel's travel lost to
+ *                               slip (0 0), standard deviation of the
+ *                               random slip added every ms (0), and seed
+ *      wall X0 Y0 X1 Y1         rectangular obstacle
+ *      patch X0 Y0 X1 Y1 R G B  floor patch, as the half periods in us the
+ *                               TCS3200 puts out; later patches lie on top
+ *      floor R G B              colour of the rest of the floor (none, the
+ *                               sampler has no reading)
+ *  Script, in time order:
+ *      MS command NAME|NUMBER [PARAM...]
+ *                               send a command frame: forward, reverse,
+ *                               left, right, stop, stats, clear,
+ *                               subscribe, unsubscribe, pid, pose,
+ *                               params, setparam, saveparams
+ *      MS estop                 send an emergency stop token
+ *      MS end                   print where the robot ended up and exit
+ *
+ *  With ALEX_HOST_TRACE, the pose, encoder ticks and sensor readings go to
+ *  a CSV file every WORLD_TRACE_MS.
+ */
+
+#define WORLD_TRACE_MS 10
+
+// Read ALEX_HOST_WORLD, if set. Called by halSetup().
+void setupWorld();
+
+// Advance the world by a millisecond. Called on the interrupt thread.
+void worldTick();
+
+#endif /* WORLD_H_ */
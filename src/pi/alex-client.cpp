@@ -0,0 +1,491 @@
+#include "alex-client.h"
+#include <string.h>
+#include <algorithm>
+#include "serial.h"
+
+AlexClient::AlexClient()
+    : _running(false),
+      _outboxSent(0),
+      _outstanding(0),
+      _taken(0),
+      _synced(false),
+      _stopping(false),
+      _stopSeq(0),
+      _helloSeq(0),
+      _helloLen(0),
+      _seq(0) {}
+
+AlexClient::~AlexClient() {
+    disconnect();
+}
+
+void AlexClient::connect(const char* portName, int baudRate) {
+    startSerial(portName, baudRate, 8, 'N', 1, 5);
+    hello();
+
+    _running = true;
+    _receiver = std::thread(&AlexClient::receiveLoop, this);
+}
+
+void AlexClient::disconnect() {
+    if (!_running.exchange(false)) {
+        return;
+    }
+
+    _receiver.join();
+    endSerial();
+}
+
+void AlexClient::hello() {
+    std::lock_guard<std::mutex> guard(_sendLock);
+    sendHello();
+    drainOutbox();
+}
+
+void AlexClient::onPacket(std::function<void(TPacket*)> handler) {
+    _packetHandler = std::move(handler);
+}
+
+void AlexClient::onError(std::function<void(TResult)> handler) {
+    _errorHandler = std::move(handler);
+}
+
+void AlexClient::post(TPacket* packet) {
+    packet->seq = 0;
+    send(packet);
+}
+
+AlexClient::Command AlexClient::emergencyStop() {
+    Command command = makeCommand(COMMAND_STOP, 0, 0, RESP_OK);
+    command._urgent = true;
+
+    return command;
+}
+
+void AlexClient::postEmergencyStop() {
+    // Its own seq, so the RESP_OK can be told apart from other posts'
+    char seq = nextSeq();
+    char buffer[STOP_TOKEN_SIZE];
+    int len = serializeStop(buffer, seq);
+
+    sendUrgent(buffer, len, seq);
+}
+
+AlexClient::Command AlexClient::forward(uint32_t dist, uint32_t speed) {
+    return makeCommand(COMMAND_FORWARD, dist, speed, RESP_OK);
+}
+
+AlexClient::Command AlexClient::reverse(uint32_t dist, uint32_t speed) {
+    return makeCommand(COMMAND_REVERSE, dist, speed, RESP_OK);
+}
+
+AlexClient::Command AlexClient::left(uint32_t ang, uint32_t speed) {
+    return makeCommand(COMMAND_TURN_LEFT, ang, speed, RESP_OK);
+}
+
+AlexClient::Command AlexClient::right(uint32_t ang, uint32_t speed) {
+    return makeCommand(COMMAND_TURN_RIGHT, ang, speed, RESP_OK);
+}
+
+AlexClient::Command AlexClient::stop() {
+    return makeCommand(COMMAND_STOP, 0, 0, RESP_OK);
+}
+
+AlexClient::Command AlexClient::getStats() {
+    return makeCommand(COMMAND_GET_STATS, 0, 0, RESP_STATUS);
+}
+
+AlexClient::Command AlexClient::clearStats() {
+    return makeCommand(COMMAND_CLEAR_STATS, 0, 0, RESP_OK);
+}
+
+AlexClient::Command AlexClient::subscribe(uint32_t telemetryMask,
+                                          uint32_t periodMs,
+                                          uint32_t fields) {
+    return makeCommand(COMMAND_SUBSCRIBE, telemetryMask, periodMs, RESP_OK,
+                       fields);
+}
+
+AlexClient::Command AlexClient::unsubscribe() {
+    return makeCommand(COMMAND_UNSUBSCRIBE, 0, 0, RESP_OK);
+}
+
+AlexClient::Command AlexClient::setPid(uint32_t kp, uint32_t ki, uint32_t kd) {
+    return makeCommand(COMMAND_SET_PID, kp, ki, RESP_OK, kd);
+}
+
+AlexClient::Command AlexClient::getProfile(bool clear) {
+    return makeCommand(COMMAND_GET_PROFILE, clear ? 1 : 0, 0, RESP_PROFILE);
+}
+
+AlexClient::Command AlexClient::getPose(bool reset) {
+    return makeCommand(COMMAND_GET_POSE, reset ? 1 : 0, 0, RESP_POSE);
+}
+
+AlexClient::Command AlexClient::getParams() {
+    return makeCommand(COMMAND_GET_PARAMS, 0, 0, RESP_PARAMS);
+}
+
+AlexClient::Command AlexClient::getFields(uint32_t fields) {
+    return makeCommand(COMMAND_GET_FIELDS, fields, 0, RESP_FIELDS);
+}
+
+AlexClient::Command AlexClient::getTasks() {
+    return makeCommand(COMMAND_GET_TASKS, 0, 0, RESP_TASKS);
+}
+
+AlexClient::Command AlexClient::setParam(uint32_t param, uint32_t value) {
+    return makeCommand(COMMAND_SET_PARAM, param, value, RESP_OK);
+}
+
+AlexClient::Command AlexClient::saveParams(bool defaults) {
+    return makeCommand(COMMAND_SAVE_PARAMS, defaults ? 1 : 0, 0, RESP_OK);
+}
+
+AlexClient::Command AlexClient::command(TCommandType type,
+                                        uint32_t param0,
+                                        uint32_t param1) {
+    return makeCommand(type, param0, param1, RESP_OK);
+}
+
+AlexClient::Command AlexClient::makeCommand(TCommandType type,
+                                            uint32_t param0,
+                                            uint32_t param1,
+                                            char expect,
+                                            uint32_t param2) {
+    TPacket packet;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.packetType = PACKET_TYPE_COMMAND;
+    packet.command = type;
+    packet.params[0] = param0;
+    packet.params[1] = param1;
+    packet.params[2] = param2;
+
+    return Command(this, packet, expect);
+}
+
+void AlexClient::Command::await_suspend(std::coroutine_handle<> caller) {
+    // Serialize before registering: once registered the reply may resume
+    // the caller on the receive thread and free this awaiter under us.
+    _packet.seq = _client->nextSeq();
+
+    char buffer[MAX_FRAME_SIZE];
+    int len = _urgent ? serializeStop(buffer, _packet.seq)
+                      : serialize(buffer, &_packet, sizeof(TPacket));
+
+    Pending pending;
+    pending.seq = _packet.seq;
+    pending.expect = _expect;
+    pending.caller = caller;
+    pending.reply = &_reply;
+    pending.deadline = std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(_timeoutMs);
+    if (_token) {
+        pending.cancelled = _token->_flag;
+    }
+
+    AlexClient* client = _client;
+    bool urgent = _urgent;
+    {
+        std::lock_guard<std::mutex> guard(client->_pendingLock);
+        client->_pending.push_back(pending);
+    }
+
+    if (urgent) {
+        client->sendUrgent(buffer, len, _packet.seq);
+        return;
+    }
+
+    client->transmit(buffer, len);
+}
+
+char AlexClient::nextSeq() {
+    // 0 is reserved for replies nobody is waiting for
+    unsigned char seq;
+    do {
+        seq = ++_seq;
+    } while (seq == 0);
+
+    return (char)seq;
+}
+
+void AlexClient::send(TPacket* packet) {
+    char buffer[MAX_FRAME_SIZE];
+    int len = serialize(buffer, packet, sizeof(TPacket));
+
+    transmit(buffer, len);
+}
+
+void AlexClient::sendUrgent(char* buffer, int len, char seq) {
+    // Flow control keeps the output queue short, so nothing holds
+    // _sendLock for long. Whatever was queued goes: the token overrides
+    // it, and Alex drops what it had of it. Recvbuf may still be full up
+    // to the window until then, so the hello that starts the count afresh
+    // waits for the stop's RESP_OK, see takeCredit().
+    std::lock_guard<std::mutex> guard(_sendLock);
+    serialFlushOutput();
+    _outbox.clear();
+    _outboxSent = 0;
+
+    serialWrite(buffer, len);
+    _stopping = true;
+    _stopSeq = seq;
+    _synced = false;
+    _creditTime = std::chrono::steady_clock::now();
+}
+
+void AlexClient::transmit(const char* buffer, int len) {
+    std::lock_guard<std::mutex> guard(_sendLock);
+
+    // Waiting for credit, if it comes to that, starts now
+    if (_outbox.empty()) {
+        _creditTime = std::chrono::steady_clock::now();
+    }
+
+    _outbox.emplace_back(buffer, len);
+    drainOutbox();
+}
+
+// Write as much of the outbox as Alex has room for. A frame is split if
+// need be, so the line never idles while Alex catches up. Under _sendLock.
+void AlexClient::drainOutbox() {
+    if (_stopping) {
+        return;
+    }
+
+    while (!_outbox.empty() && _outstanding < RECV_WINDOW) {
+        std::string& frame = _outbox.front();
+        int len = std::min<int>(frame.size() - _outboxSent,
+                                RECV_WINDOW - _outstanding);
+
+        serialWrite(&frame[_outboxSent], len);
+        _outstanding += len;
+        _outboxSent += len;
+
+        if (_outboxSent == frame.size()) {
+            _outbox.pop_front();
+            _outboxSent = 0;
+        }
+    }
+}
+
+// Alex starts counting from 0 once it takes the hello, and says so in
+// its RESP_OK. The hello goes without credit: only send it when Alex's
+// buffer is empty, or about to be. Under _sendLock.
+void AlexClient::sendHello() {
+    TPacket packet;
+
+    memset(&packet, 0, sizeof(packet));
+    packet.packetType = PACKET_TYPE_HELLO;
+    packet.seq = nextSeq();
+
+    char buffer[MAX_FRAME_SIZE];
+    int len = serialize(buffer, &packet, sizeof(TPacket));
+    serialWrite(buffer, len);
+
+    _helloSeq = packet.seq;
+    _helloLen = len;
+    _outstanding = len;
+    _taken = 0;
+    _synced = false;
+    _creditTime = std::chrono::steady_clock::now();
+}
+
+// Every frame from Alex says how much it has taken; free that much of the
+// window and send what now fits. Returns true for the RESP_OK to our own
+// hello, which nobody else wants.
+bool AlexClient::takeCredit(const TPacket* packet) {
+    std::lock_guard<std::mutex> guard(_sendLock);
+    unsigned char taken = packet->credit;
+    bool isHello = false;
+
+    // Alex has dropped everything before the stop token, so its buffer is
+    // empty and the hello can go
+    if (_stopping) {
+        if (packet->packetType == PACKET_TYPE_RESPONSE &&
+            packet->command == RESP_OK && packet->seq == _stopSeq) {
+            _stopping = false;
+            sendHello();
+            drainOutbox();
+        }
+        return false;
+    }
+
+    if (!_synced) {
+        // Counts from before Alex took our hello mean nothing to us
+        if (packet->packetType != PACKET_TYPE_RESPONSE ||
+            packet->command != RESP_OK || packet->seq != _helloSeq) {
+            return false;
+        }
+
+        _synced = true;
+        _outstanding -= _helloLen;
+        isHello = true;
+    }
+
+    _outstanding -= (unsigned char)(taken - _taken);
+    if (_outstanding < 0) {
+        _outstanding = 0;
+    }
+    _taken = taken;
+    _creditTime = std::chrono::steady_clock::now();
+
+    drainOutbox();
+    return isHello;
+}
+
+void AlexClient::checkStall() {
+    std::lock_guard<std::mutex> guard(_sendLock);
+
+    // Nothing to recover while in step with Alex and no frame waits
+    if (_outbox.empty() && _synced) {
+        return;
+    }
+    if (std::chrono::steady_clock::now() - _creditTime <
+        std::chrono::milliseconds(ALEX_STALL_MS)) {
+        return;
+    }
+    _stopping = false;
+
+    // Finish the frame we were partway through, or its start would
+    // swallow the hello
+    if (_outboxSent > 0) {
+        std::string& frame = _outbox.front();
+        serialWrite(&frame[_outboxSent], frame.size() - _outboxSent);
+        _outbox.pop_front();
+        _outboxSent = 0;
+    }
+
+    sendHello();
+    drainOutbox();
+}
+
+void AlexClient::receiveLoop() {
+    char buffer[MAX_BUFFER_LEN];
+    TFrameParser parser = {};
+    int len;
+    int used;
+    TResult result;
+
+    while (_running) {
+        if (serialPoll(ALEX_POLL_MS) > 0) {
+            len = serialRead(buffer, sizeof(buffer));
+
+            // A single read may hold several frames
+            for (int i = 0; i < len; i += used) {
+                result = parseFrame(&parser, &buffer[i], len - i, &used);
+
+                if (result == PACKET_OK) {
+                    dispatch((TPacket*)framePayload(&parser));
+                } else if (result != PACKET_INCOMPLETE && _errorHandler) {
+                    _errorHandler(result);
+                }
+            }
+        }
+
+        expirePending(false);
+        checkStall();
+    }
+
+    expirePending(true);
+}
+
+void AlexClient::dispatch(TPacket* packet) {
+    if (takeCredit(packet)) {
+        return;
+    }
+
+    if (packet->seq != 0) {
+        std::unique_lock<std::mutex> guard(_pendingLock);
+
+        for (size_t i = 0; i < _pending.size(); i++) {
+            Pending pending = _pending[i];
+            if (pending.seq != packet->seq) {
+                continue;
+            }
+
+            if (packet->packetType == PACKET_TYPE_ERROR) {
+                pending.reply->status = ALEX_REJECTED;
+            } else if (packet->packetType == PACKET_TYPE_RESPONSE &&
+                       packet->command == pending.expect) {
+                pending.reply->status = ALEX_OK;
+            } else {
+                // e.g. a RESP_OK to a command this one does not expect
+                return;
+            }
+
+            pending.reply->packet = *packet;
+            _pending.erase(_pending.begin() + i);
+            guard.unlock();
+
+            pending.caller.resume();
+            return;
+        }
+    }
+
+    // Nobody is waiting for this one, e.g. telemetry or a late reply
+    if (_packetHandler) {
+        _packetHandler(packet);
+    }
+}
+
+void AlexClient::expirePending(bool closing) {
+    std::vector<Pending> expired;
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+
+    {
+        std::lock_guard<std::mutex> guard(_pendingLock);
+
+        for (size_t i = 0; i < _pending.size();) {
+            Pending& pending = _pending[i];
+
+            if (closing) {
+                pending.reply->status = ALEX_CLOSED;
+            } else if (pending.cancelled && pending.cancelled->load()) {
+                pending.reply->status = ALEX_CANCELLED;
+            } else if (now >= pending.deadline) {
+                pending.reply->status = ALEX_TIMEOUT;
+            } else {
+                i++;
+                continue;
+            }
+
+            expired.push_back(pending);
+            _pending.erase(_pending.begin() + i);
+        }
+    }
+
+    // Resume without holding the lock, callers will issue more commands
+    for (Pending& pending : expired) {
+        pending.caller.resume();
+    }
+}
+
+// In TParam order
+static const char* const PARAM_NAMES[PARAM_COUNT] = {
+    "wheel_circ",      // PARAM_WHEEL_CIRC
+    "turn_diameter",   // PARAM_TURN_DIAMETER
+    "near",            // PARAM_NEAR_CM
+    "red_max",         // PARAM_RED_MAX
+    "red_green_min",   // PARAM_RED_GREEN_MIN
+    "green_blue_max",  // PARAM_GREEN_BLUE_MAX
+    "kp",              // PARAM_SPEED_KP
+    "ki",              // PARAM_SPEED_KI
+    "kd",              // PARAM_SPEED_KD
+};
+
+const char* alexParamName(uint32_t param) {
+    return param < PARAM_COUNT ? PARAM_NAMES[param] : NULL;
+}
+
+int alexParamId(const char* name) {
+    for (int i = 0; i < PARAM_COUNT; i++) {
+        if (strcmp(name, PARAM_NAMES[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
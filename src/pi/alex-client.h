@@ -0,0 +1,476 @@
+#ifndef ALEX_CLIENT_H_
+#define ALEX_CLIENT_H_
+
+/*
+ *  Asynchronous client for Alex, usable from planners and tests as well as
+ *  the interactive alex-pi program. Built into libalex.a.
+ *
+ *  Every command is an awaitable that sends the packet when awaited and
+ *  resumes once the matching reply arrives:
+ *
+ *      AlexTask<bool> square(AlexClient& robot) {
+ *          for (int i = 0; i < 4; i++) {
+ *              TAlexReply r = co_await robot.forward(20, 80).within(500);
+ *              if (r.status != ALEX_OK) {
+ *                  co_return false;
+ *              }
+ *              co_await robot.right(90, 80);
+ *          }
+ *          co_return true;
+ *      }
+ *
+ *      bool ok = alexSyncWait(square(robot));
+ *
+ *  Replies are matched to commands through TPacket::seq, so any number of
+ *  commands can be in flight at once (see alexWhenAll). Coroutines resume on
+ *  the receive thread; never block it by calling alexSyncWait from inside a
+ *  coroutine.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../common/constants.h"
+#include "../common/packet.h"
+#include "../common/serialize.h"
+
+// Default time to wait for a reply. A frame takes ~146 ms each way at 9600
+// baud, and Alex may have a few queued ahead of ours.
+#define ALEX_DEFAULT_TIMEOUT_MS 1000
+
+// How often the receive thread checks deadlines and cancellations
+#define ALEX_POLL_MS 10
+
+// Frames waiting for flow control credit, or a hello or stop waiting for
+// its RESP_OK, this long without Alex taking anything mean bytes went
+// missing on the way, or Alex reset: send a hello to start counting afresh
+#define ALEX_STALL_MS 1000
+
+// How a command round trip ended
+typedef enum {
+    ALEX_OK = 0,         // The matching RESP_OK or RESP_STATUS arrived
+    ALEX_REJECTED = 1,   // Alex answered with a PACKET_TYPE_ERROR
+    ALEX_TIMEOUT = 2,    // No matching reply before the deadline
+    ALEX_CANCELLED = 3,  // Cancelled through its AlexCancelToken
+    ALEX_CLOSED = 4      // The client disconnected while we waited
+} TAlexStatus;
+
+typedef struct {
+    TAlexStatus status;
+    TPacket packet;  // The reply itself, valid for ALEX_OK and ALEX_REJECTED
+} TAlexReply;
+
+// Cancels every command it was handed to. Copies share the same state.
+class AlexCancelToken {
+   public:
+    AlexCancelToken() : _flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { _flag->store(true); }
+    bool cancelled() const { return _flag->load(); }
+
+   private:
+    friend class AlexClient;
+    std::shared_ptr<std::atomic<bool>> _flag;
+};
+
+template <typename T>
+class AlexTask;
+
+// Common part of AlexTask's promise: who to resume when we finish
+struct AlexPromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<P> h) noexcept {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct AlexPromise : AlexPromiseBase {
+    std::optional<T> value;
+
+    AlexTask<T> get_return_object();
+    void return_value(T v) { value.emplace(std::move(v)); }
+
+    T result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+};
+
+template <>
+struct AlexPromise<void> : AlexPromiseBase {
+    AlexTask<void> get_return_object();
+    void return_void() {}
+
+    void result() {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// Lazily started coroutine returning T. Starts when awaited, or when
+// handed to alexSyncWait / alexWhenAll.
+template <typename T>
+class AlexTask {
+   public:
+    typedef AlexPromise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit AlexTask(Handle h) : _handle(h) {}
+    AlexTask(AlexTask&& other) noexcept
+        : _handle(std::exchange(other._handle, nullptr)) {}
+    AlexTask(const AlexTask&) = delete;
+    AlexTask& operator=(const AlexTask&) = delete;
+    ~AlexTask() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        _handle.promise().continuation = caller;
+        return _handle;
+    }
+
+    T await_resume() { return _handle.promise().result(); }
+
+   private:
+    Handle _handle;
+};
+
+template <typename T>
+AlexTask<T> AlexPromise<T>::get_return_object() {
+    return AlexTask<T>(std::coroutine_handle<AlexPromise<T>>::from_promise(*this));
+}
+
+inline AlexTask<void> AlexPromise<void>::get_return_object() {
+    return AlexTask<void>(
+        std::coroutine_handle<AlexPromise<void>>::from_promise(*this));
+}
+
+// Eagerly started coroutine that nobody awaits; cleans up after itself
+struct AlexDetached {
+    struct promise_type {
+        AlexDetached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// Run "task" to completion, blocking the calling thread
+template <typename T>
+struct AlexSyncState {
+    std::mutex lock;
+    std::condition_variable done;
+    bool finished = false;
+    std::optional<T> value;
+    std::exception_ptr error;
+};
+
+template <>
+struct AlexSyncState<void> {
+    std::mutex lock;
+    std::condition_variable done;
+    bool finished = false;
+    std::exception_ptr error;
+};
+
+template <typename T>
+AlexDetached alexRunSync(AlexTask<T>& task, AlexSyncState<T>* state) {
+    try {
+        if constexpr (std::is_void_v<T>) {
+            co_await task;
+        } else {
+            state->value.emplace(co_await task);
+        }
+    } catch (...) {
+        state->error = std::current_exception();
+    }
+
+    // Notify under the lock, the waiter owns "state" once it can see it
+    std::lock_guard<std::mutex> guard(state->lock);
+    state->finished = true;
+    state->done.notify_one();
+}
+
+template <typename T>
+T alexSyncWait(AlexTask<T> task) {
+    AlexSyncState<T> state;
+
+    alexRunSync(task, &state);
+
+    std::unique_lock<std::mutex> guard(state.lock);
+    state.done.wait(guard, [&] { return state.finished; });
+
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+    if constexpr (!std::is_void_v<T>) {
+        return std::move(*state.value);
+    }
+}
+
+// Run all "tasks" concurrently and resume once every one has finished.
+// Results come back in the order the tasks were given.
+template <typename T>
+struct AlexWhenAllState {
+    std::atomic<size_t> remaining;
+    std::coroutine_handle<> parent;
+    std::vector<std::optional<T>> results;
+    std::exception_ptr error;
+    std::mutex errorLock;
+};
+
+template <typename T>
+AlexDetached alexRunChild(AlexTask<T>& task,
+                          AlexWhenAllState<T>* state,
+                          size_t index) {
+    try {
+        state->results[index].emplace(co_await task);
+    } catch (...) {
+        std::lock_guard<std::mutex> guard(state->errorLock);
+        if (!state->error) {
+            state->error = std::current_exception();
+        }
+    }
+
+    if (state->remaining.fetch_sub(1) == 1) {
+        state->parent.resume();
+    }
+}
+
+template <typename T>
+AlexTask<std::vector<T>> alexWhenAll(std::vector<AlexTask<T>> tasks) {
+    AlexWhenAllState<T> state;
+    state.results.resize(tasks.size());
+
+    struct StartAll {
+        std::vector<AlexTask<T>>& tasks;
+        AlexWhenAllState<T>& state;
+
+        bool await_ready() const noexcept { return tasks.empty(); }
+
+        bool await_suspend(std::coroutine_handle<> parent) {
+            // One extra count held by us, so that children finishing
+            // while we are still starting the rest cannot resume parent
+            state.parent = parent;
+            state.remaining.store(tasks.size() + 1);
+            for (size_t i = 0; i < tasks.size(); i++) {
+                alexRunChild(tasks[i], &state, i);
+            }
+            return state.remaining.fetch_sub(1) != 1;
+        }
+
+        void await_resume() const noexcept {}
+    };
+
+    co_await StartAll{tasks, state};
+
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+
+    std::vector<T> results;
+    results.reserve(state.results.size());
+    for (std::optional<T>& result : state.results) {
+        results.push_back(std::move(*result));
+    }
+    co_return results;
+}
+
+class AlexClient {
+   public:
+    // Awaitable round trip for one command. Sends when awaited.
+    class Command {
+       public:
+        // Give up with ALEX_TIMEOUT after "timeoutMs"
+        Command& within(int timeoutMs) {
+            _timeoutMs = timeoutMs;
+            return *this;
+        }
+
+        // Give up with ALEX_CANCELLED once "token" is cancelled
+        Command& cancelledBy(const AlexCancelToken& token) {
+            _token = token;
+            return *this;
+        }
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> caller);
+        TAlexReply await_resume() const { return _reply; }
+
+       private:
+        friend class AlexClient;
+        Command(AlexClient* client, const TPacket& packet, char expect)
+            : _client(client), _packet(packet), _expect(expect) {}
+
+        AlexClient* _client;
+        TPacket _packet;
+        char _expect;  // Response type that completes the command
+        bool _urgent = false;  // Sent as a stop token, see emergencyStop()
+        int _timeoutMs = ALEX_DEFAULT_TIMEOUT_MS;
+        std::optional<AlexCancelToken> _token;
+        TAlexReply _reply;
+    };
+
+    AlexClient();
+    ~AlexClient();
+    AlexClient(const AlexClient&) = delete;
+    AlexClient& operator=(const AlexClient&) = delete;
+
+    // Open the serial port, send a hello and start the receive thread.
+    // There is only one serial port per process, so only one client may be
+    // connected.
+    void connect(const char* portName, int baudRate);
+
+    // Start flow control afresh (see RECV_WINDOW). Needed again once Alex
+    // has rebooted, e.g. after opening the port reset it. Frames are held
+    // back, never dropped, while Alex's buffer is full, so a burst of
+    // commands goes out at the wire rate rather than overrunning it.
+    void hello();
+
+    // Stop the receive thread and fail whatever is still waiting
+    void disconnect();
+
+    // Called on the receive thread for every packet no command is waiting
+    // for: pushed telemetry, messages, replies to post()ed packets.
+    void onPacket(std::function<void(TPacket*)> handler);
+
+    // Called on the receive thread for frames that failed to deserialize
+    void onError(std::function<void(TResult)> handler);
+
+    // Fire and forget. Replies show up in the onPacket handler.
+    void post(TPacket* packet);
+
+    // Stop now, ahead of everything else. Output not yet sent is discarded
+    // and a stop token (see matchStop()) goes out instead of a frame; Alex
+    // stops the motors in its receive interrupt and drops any commands it
+    // had not started yet, which then time out here. Commands sent after
+    // wait until Alex has acknowledged the stop and taken a new hello.
+    // Worst case, call to PWM cut at 9600 baud:
+    //   6.3 ms        for the token itself,
+    //   + < 1 ms      for Alex's receive interrupt (see alex.cpp),
+    // plus whatever the USB serial bridge has buffered, never more than
+    // RECV_WINDOW bytes (260 ms) with flow control. A COMMAND_STOP
+    // frame instead waits behind everything queued both here and on Alex.
+    // Resumes with the RESP_OK Alex sends once stopped.
+    Command emergencyStop();
+
+    // emergencyStop(), fire and forget
+    void postEmergencyStop();
+
+    // For movement commands, dist is in cm, ang in degrees, speed in %
+    Command forward(uint32_t dist, uint32_t speed);
+    Command reverse(uint32_t dist, uint32_t speed);
+    Command left(uint32_t ang, uint32_t speed);
+    Command right(uint32_t ang, uint32_t speed);
+    Command stop();
+    Command getStats();  // Resumes with the RESP_STATUS packet
+    Command clearStats();
+    // "fields" is the TStatusField mask for TELEMETRY_FIELDS
+    Command subscribe(uint32_t telemetryMask,
+                      uint32_t periodMs,
+                      uint32_t fields = 0);
+    Command unsubscribe();
+    Command setPid(uint32_t kp, uint32_t ki, uint32_t kd);  // In 1/256ths
+    Command getProfile(bool clear = false);  // Resumes with RESP_PROFILE
+    Command getPose(bool reset = false);     // Resumes with RESP_POSE
+    Command getParams();  // Resumes with RESP_PARAMS
+    Command getFields(uint32_t fields);  // TStatusField mask, RESP_FIELDS
+    Command getTasks();  // Resumes with RESP_TASKS
+    Command setParam(uint32_t param, uint32_t value);
+    Command saveParams(bool defaults = false);
+
+    // Any command, resuming when a RESP_OK comes back
+    Command command(TCommandType type, uint32_t param0 = 0, uint32_t param1 = 0);
+
+   private:
+    struct Pending {
+        char seq;
+        char expect;
+        std::coroutine_handle<> caller;
+        TAlexReply* reply;
+        std::chrono::steady_clock::time_point deadline;
+        std::shared_ptr<std::atomic<bool>> cancelled;
+    };
+
+    Command makeCommand(TCommandType type,
+                        uint32_t param0,
+                        uint32_t param1,
+                        char expect,
+                        uint32_t param2 = 0);
+    char nextSeq();
+    void send(TPacket* packet);
+    void sendUrgent(char* buffer, int len, char seq);
+    void transmit(const char* buffer, int len);
+    void drainOutbox();
+    void sendHello();
+    bool takeCredit(const TPacket* packet);
+    void checkStall();
+    void receiveLoop();
+    void dispatch(TPacket* packet);
+    void expirePending(bool closing);
+
+    std::atomic<bool> _running;
+    std::thread _receiver;
+    std::mutex _sendLock;
+
+    // Flow control, see RECV_WINDOW, all under _sendLock. Frames wait in
+    // _outbox, the front one _outboxSent bytes in, until Alex has room.
+    std::deque<std::string> _outbox;
+    size_t _outboxSent;
+    int _outstanding;      // Bytes sent that Alex has not taken, it seems
+    unsigned char _taken;  // Alex's count in the last credit we took
+    bool _synced;          // The RESP_OK to our last hello is back
+    bool _stopping;        // A stop token is out, its RESP_OK is not back
+    char _stopSeq;
+    char _helloSeq;
+    int _helloLen;
+    std::chrono::steady_clock::time_point _creditTime;  // Last progress
+    std::mutex _pendingLock;
+    std::vector<Pending> _pending;
+    std::atomic<unsigned char> _seq;
+    std::function<void(TPacket*)> _packetHandler;
+    std::function<void(TResult)> _errorHandler;
+};
+
+// Short names for the parameters in TParam, e.g. "near" for PARAM_NEAR_CM
+const char* alexParamName(uint32_t param);  // NULL if there is none
+
+// -1 if "name" is not a parameter
+int alexParamId(const char* name);
+
+#endif /* ALEX_CLIENT_H_ */
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "alex-client.h"
+
+/*
+ *  Reads and changes Alex's parameters, see TParam:
+ *
+ *      alex-param [-p PORT] [NAME=VALUE...] [save | defaults]
+ *
+ *  Sets each NAME to VALUE in order, then saves them to EEPROM with
+ *  "save", or restores and saves the defaults with "defaults", and lists
+ *  what Alex ends up with. Opening the port resets an Uno, so values that
+ *  are not saved last only until the next run; alex-pi's K key sets them
+ *  over a session instead.
+ */
+
+#define BAUD_RATE B9600
+
+// Time the bootloader takes after the reset that opening the port causes
+#define RESET_WAIT_S 2
+
+static AlexTask<bool> run(AlexClient& robot, int argc, char* argv[]) {
+    for (int i = 0; i < argc; i++) {
+        TAlexReply reply;
+
+        if (strcmp(argv[i], "save") == 0 || strcmp(argv[i], "defaults") == 0) {
+            reply = co_await robot.saveParams(strcmp(argv[i], "defaults") == 0);
+        } else {
+            char name[32];
+            unsigned int value;
+            int param = -1;
+
+            if (sscanf(argv[i], "%31[^=]=%u", name, &value) == 2) {
+                param = alexParamId(name);
+            }
+            if (param < 0) {
+                fprintf(stderr, "%s: not NAME=VALUE with a known NAME\n",
+                        argv[i]);
+                co_return false;
+            }
+
+            reply = co_await robot.setParam(param, value);
+        }
+
+        if (reply.status != ALEX_OK) {
+            fprintf(stderr, "%s: %s\n", argv[i],
+                    reply.status == ALEX_REJECTED ? "refused" : "no reply");
+            co_return false;
+        }
+    }
+
+    TAlexReply reply = co_await robot.getParams();
+    if (reply.status != ALEX_OK) {
+        fprintf(stderr, "No parameters from Alex\n");
+        co_return false;
+    }
+
+    for (uint32_t i = 0; i < PARAM_COUNT; i++) {
+        printf("%s=%u\n", alexParamName(i), reply.packet.params[i]);
+    }
+
+    co_return true;
+}
+
+int main(int argc, char* argv[]) {
+    const char* port = PORT_NAME;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-p") == 0) {
+        port = argv[2];
+        first = 3;
+    }
+
+    AlexClient robot;
+    robot.connect(port, BAUD_RATE);
+    sleep(RESET_WAIT_S);
+
+    // Say hello again, the one connect() sent went to the bootloader
+    robot.hello();
+
+    bool ok = alexSyncWait(run(robot, argc - first, argv + first));
+
+    robot.disconnect();
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
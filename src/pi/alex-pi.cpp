@@ -1,35 +1,36 @@
-#include <pthread.h>
-#include <semaphore.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <termios.h>
 #include <unistd.h>
 #include "../common/constants.h"
 #include "../common/packet.h"
 #include "../common/serialize.h"
-#include "serial.h"
+#include "alex-client.h"
+#include "logger.h"
 
 //#define PORT_NAME			"/dev/ttyACM0"
 #define BAUD_RATE B9600
 
 int exitFlag = 0;
-sem_t _xmitSema;
+AlexClient robot;
 
-void handleError(TResult error) {
+void handleError(TResult error, FILE* out) {
     switch (error) {
         case PACKET_BAD:
-            printf("ERROR: Bad Magic Number\n");
+            fprintf(out, "ERROR: Bad Magic Number\n");
             break;
 
         case PACKET_CHECKSUM_BAD:
-            printf("ERROR: Bad checksum\n");
+            fprintf(out, "ERROR: Bad checksum\n");
             break;
 
         default:
-            printf("ERROR: UNKNOWN ERROR\n");
+            fprintf(out, "ERROR: UNKNOWN ERROR\n");
     }
 }
 
-void handleStatus(TPacket* packet) {
+void handleStatus(const TPacket* packet, FILE* out) {
     // printf("\n ------- ALEX STATUS REPORT ------- \n\n");
     // printf("Left Forward Ticks:\t\t%d\n", packet->params[0]);
     // printf("Right Forward Ticks:\t\t%d\n", packet->params[1]);
@@ -45,109 +46,236 @@ void handleStatus(TPacket* packet) {
     // printf("Red Colour:\t\t%d\n", packet->params[10]);
     // printf("Green Colour:\t\t%d\n", packet->params[11]);
     // printf("Blue Colour:\t\t%d\n", packet->params[12]);
-    printf("Colour:\t\t%d\n", packet->params[0]);
-    printf("R:\t\t%d\n", packet->params[1]);
-    printf("G:\t\t%d\n", packet->params[2]);
-    printf("B:\t\t%d\n", packet->params[3]);
-    printf("Distance:\t\t%d\n", packet->params[4]);
+    fprintf(out, "Colour:\t\t%d\n", packet->params[0]);
+    fprintf(out, "R:\t\t%d\n", packet->params[1]);
+    fprintf(out, "G:\t\t%d\n", packet->params[2]);
+    fprintf(out, "B:\t\t%d\n", packet->params[3]);
+    fprintf(out, "Distance:\t\t%d\n", packet->params[4]);
     // printf("\n---------------------------------------\n\n");
 }
 
-void handleResponse(TPacket* packet) {
+void handleTicks(const TPacket* packet, FILE* out) {
+    fprintf(out, "\n ------- ALEX TICKS REPORT ------- \n\n");
+    fprintf(out, "Left Forward Ticks:\t\t%d\n", packet->params[0]);
+    fprintf(out, "Right Forward Ticks:\t\t%d\n", packet->params[1]);
+    fprintf(out, "Left Reverse Ticks:\t\t%d\n", packet->params[2]);
+    fprintf(out, "Right Reverse Ticks:\t\t%d\n", packet->params[3]);
+    fprintf(out, "Left Forward Ticks Turns:\t%d\n", packet->params[4]);
+    fprintf(out, "Right Forward Ticks Turns:\t%d\n", packet->params[5]);
+    fprintf(out, "Left Reverse Ticks Turns:\t%d\n", packet->params[6]);
+    fprintf(out, "Right Reverse Ticks Turns:\t%d\n", packet->params[7]);
+    fprintf(out, "Forward Distance:\t\t%d\n", packet->params[8]);
+    fprintf(out, "Reverse Distance:\t\t%d\n", packet->params[9]);
+}
+
+void handleProfile(const TPacket* packet, FILE* out) {
+    static const char* const names[PROFILE_REGIONS] = {
+        "Left encoder ISR", "USART RX ISR", "handleCommand", "sendStatus"};
+
+    fprintf(out, "\n ------- ALEX PROFILE (CPU cycles) ------- \n\n");
+    fprintf(out, "%-16s %10s %8s %8s %8s\n", "Region", "Calls", "Min", "Avg",
+            "Max");
+    for (int i = 0; i < PROFILE_REGIONS; i++) {
+        const uint32_t* p = &packet->params[4 * i];
+        fprintf(out, "%-16s %10u %8u %8u %8u\n", names[i], p[0], p[1], p[2],
+                p[3]);
+    }
+}
+
+void handleTasks(const TPacket* packet, FILE* out) {
+    static const char* const names[TASK_COUNT] = {"Motion", "Packets",
+                                                  "Colour", "Telemetry"};
+
+    fprintf(out, "\n ------- ALEX TASKS (run time in us) ------- \n\n");
+    fprintf(out, "%-10s %10s %8s %8s %8s\n", "Task", "Runs", "Late", "Last",
+            "Max");
+    for (int i = 0; i < TASK_COUNT; i++) {
+        const uint32_t* p = &packet->params[4 * i];
+        fprintf(out, "%-10s %10u %8u %8.1f %8.1f\n", names[i], p[0], p[1],
+                p[2] / 2.0, p[3] / 2.0);
+    }
+}
+
+void handlePose(const TPacket* packet, FILE* out) {
+    // x and y are signed 0.1 mm, the heading 65536ths of a turn
+    fprintf(out, "Pose:\t\tx %.1f cm, y %.1f cm, heading %.1f deg\n",
+            (int32_t)packet->params[0] / 100.0,
+            (int32_t)packet->params[1] / 100.0,
+            packet->params[2] * 360.0 / 65536);
+}
+
+// Only the fields Alex says it sent, their values packed in field order
+void handleFields(const TPacket* packet, FILE* out) {
+    uint32_t fields = packet->params[0];
+    const uint32_t* value = &packet->params[1];
+
+    if (fields & STATUS_COLOUR) {
+        fprintf(out, "Colour:\t\t%u (R %u, G %u, B %u)\n", value[0], value[1],
+                value[2], value[3]);
+        value += 4;
+    }
+    if (fields & STATUS_RANGE) {
+        fprintf(out, "Distance:\t%u cm\n", value[0]);
+        value += 1;
+    }
+    if (fields & STATUS_TICKS) {
+        fprintf(out, "Ticks:\t\tforward L %u R %u, reverse L %u R %u\n",
+                value[0], value[1], value[2], value[3]);
+        fprintf(out, "Turn ticks:\tforward L %u R %u, reverse L %u R %u\n",
+                value[4], value[5], value[6], value[7]);
+        value += 8;
+    }
+    if (fields & STATUS_DISTANCE) {
+        fprintf(out, "Travelled:\tforward %u cm, reverse %u cm\n", value[0],
+                value[1]);
+        value += 2;
+    }
+    if (fields & STATUS_POSE) {
+        fprintf(out, "Pose:\t\tx %.1f cm, y %.1f cm, heading %.1f deg\n",
+                (int32_t)value[0] / 100.0, (int32_t)value[1] / 100.0,
+                value[2] * 360.0 / 65536);
+        value += 3;
+    }
+    if (fields & STATUS_LINK) {
+        fprintf(out,
+                "Link:\t\t%u frames, %u bad packets, %u bad checksums, %u "
+                "bytes dropped\n",
+                value[0], value[1], value[2], value[3]);
+        value += 4;
+    }
+    if (fields & STATUS_SPEED) {
+        fprintf(out, "Wheel speed:\tleft %.1f, right %.1f ticks/s\n",
+                value[0] / 256.0, value[1] / 256.0);
+        value += 2;
+    }
+}
+
+void handleParams(const TPacket* packet, FILE* out) {
+    fprintf(out, "\n ------- ALEX PARAMETERS ------- \n\n");
+    for (uint32_t i = 0; i < PARAM_COUNT; i++) {
+        fprintf(out, "%-16s%u\n", alexParamName(i), packet->params[i]);
+    }
+}
+
+void handleResponse(const TPacket* packet, FILE* out) {
     // The response code is stored in command
     switch (packet->command) {
         case RESP_OK:
-            printf("Command OK\n");
+            fprintf(out, "Command OK\n");
             break;
 
         case RESP_STATUS:
-            handleStatus(packet);
+            handleStatus(packet, out);
+            break;
+
+        case RESP_TICKS:
+            handleTicks(packet, out);
+            break;
+
+        case RESP_PROFILE:
+            handleProfile(packet, out);
+            break;
+
+        case RESP_POSE:
+            handlePose(packet, out);
+            break;
+
+        case RESP_PARAMS:
+            handleParams(packet, out);
+            break;
+
+        case RESP_FIELDS:
+            handleFields(packet, out);
+            break;
+
+        case RESP_TASKS:
+            handleTasks(packet, out);
             break;
 
         default:
-            printf("Arduino is confused\n");
+            fprintf(out, "Arduino is confused\n");
     }
 }
 
-void handleErrorResponse(TPacket* packet) {
+void handleErrorResponse(const TPacket* packet, FILE* out) {
     // The error code is returned in command
     switch (packet->command) {
         case RESP_BAD_PACKET:
-            printf("Arduino received bad magic number\n");
+            fprintf(out, "Arduino received bad magic number\n");
             break;
 
         case RESP_BAD_CHECKSUM:
-            printf("Arduino received bad checksum\n");
+            fprintf(out, "Arduino received bad checksum\n");
             break;
 
         case RESP_BAD_COMMAND:
-            printf("Arduino received bad command\n");
+            fprintf(out, "Arduino received bad command\n");
             break;
 
         case RESP_BAD_RESPONSE:
-            printf("Arduino received unexpected response\n");
+            fprintf(out, "Arduino received unexpected response\n");
+            break;
+
+        case RESP_BAD_PARAM:
+            fprintf(out, "Arduino refused the parameter or its value\n");
             break;
 
         default:
-            printf("Arduino reports a weird error\n");
+            fprintf(out, "Arduino reports a weird error\n");
     }
 }
 
-void handleMessage(TPacket* packet) {
-    printf("Message from Alex: %s\n", packet->data);
+void handleMessage(const TPacket* packet, FILE* out) {
+    fprintf(out, "Message from Alex: %.*s\n", MAX_STR_LEN, packet->data);
 }
 
-void handlePacket(TPacket* packet) {
+void handlePacket(const TPacket* packet, FILE* out) {
     switch (packet->packetType) {
         case PACKET_TYPE_COMMAND:
             // Only we send command packets, so ignore
             break;
 
         case PACKET_TYPE_RESPONSE:
-            handleResponse(packet);
+            handleResponse(packet, out);
             break;
 
         case PACKET_TYPE_ERROR:
-            handleErrorResponse(packet);
+            handleErrorResponse(packet, out);
             break;
 
         case PACKET_TYPE_MESSAGE:
-            handleMessage(packet);
+            handleMessage(packet, out);
             break;
     }
 }
 
 void sendPacket(TPacket* packet) {
-    char buffer[PACKET_SIZE];
-    int len = serialize(buffer, packet, sizeof(TPacket));
-
-    serialWrite(buffer, len);
+    robot.post(packet);
 }
 
-void* receiveThread(void* p) {
-    char buffer[PACKET_SIZE];
-    int len;
-    TPacket packet;
-    TResult result;
-    int counter = 0;
-
-    while (1) {
-        len = serialRead(buffer);
-        counter += len;
-        if (len > 0) {
-            result = deserialize(buffer, len, &packet);
-
-            if (result == PACKET_OK) {
-                counter = 0;
-                handlePacket(&packet);
-            } else if (result != PACKET_INCOMPLETE) {
-                printf("PACKET ERROR\n");
-                handleError(result);
-            }
-        }
+// Runs on the logger thread, never on the receive thread
+void formatRecord(const TLogRecord* record, FILE* out) {
+    switch (record->kind) {
+        case LOG_PACKET:
+            handlePacket(&record->packet, out);
+            break;
+
+        case LOG_RECV_ERROR:
+            fprintf(out, "PACKET ERROR\n");
+            handleError((TResult)record->error, out);
+            break;
     }
 }
 
+// Called on the receive thread: only queue, let the logger do the printing
+void logReceived(TPacket* packet) {
+    logPacket(packet);
+}
+
+void logReceiveError(TResult error) {
+    logRecvError(error);
+}
+
 void flushInput() {
     char c;
 
@@ -167,6 +295,73 @@ void getParams(TPacket* commandPacket) {
     flushInput();
 }
 
+#define FIELDS_HELP                                                      \
+    "1=colour, 2=ultrasonic, 4=ticks, 8=distances, 16=pose, 32=link "  \
+    "counters, 64=wheel speeds, added up for more than one"
+
+void getTelemetryParams(TPacket* commandPacket) {
+    char line[64];
+
+    printf(
+        "Enter reports to push (1=status, 2=ticks, 4=pose, 8=fields, added "
+        "up for more than one), period in ms and, with 8, the fields ("
+        FIELDS_HELP ") (e.g. 3 1000 or 8 200 2) separated by space.\n");
+    commandPacket->params[2] = 0;
+    if (fgets(line, sizeof(line), stdin)) {
+        sscanf(line, "%u %u %u", &commandPacket->params[0],
+               &commandPacket->params[1], &commandPacket->params[2]);
+    }
+}
+
+void getFieldsParams(TPacket* commandPacket) {
+    printf("Enter the fields to get (" FIELDS_HELP ", e.g. 34).\n");
+    scanf("%u", &commandPacket->params[0]);
+    flushInput();
+}
+
+void getPidParams(TPacket* commandPacket) {
+    printf(
+        "Enter wheel speed kp, ki and kd in 1/256ths (e.g. 2560 512 0) "
+        "separated by space.\n");
+    scanf("%u %u %u", &commandPacket->params[0], &commandPacket->params[1],
+          &commandPacket->params[2]);
+    flushInput();
+}
+
+// Fills in a COMMAND_SET_PARAM or COMMAND_SAVE_PARAMS. Returns 0 for input
+// that is neither.
+int getParamCommand(TPacket* commandPacket) {
+    char line[64];
+    char name[32] = "";
+    unsigned int value;
+
+    printf(
+        "Enter a parameter name and value (e.g. near 8), \"save\" to keep "
+        "the parameters over resets or \"defaults\" to restore and save "
+        "the defaults.\n");
+    if (!fgets(line, sizeof(line), stdin)) {
+        return 0;
+    }
+
+    if (sscanf(line, "%31s %u", name, &value) == 2) {
+        int param = alexParamId(name);
+        if (param < 0) {
+            printf("No parameter called %s\n", name);
+            return 0;
+        }
+        commandPacket->command = COMMAND_SET_PARAM;
+        commandPacket->params[0] = param;
+        commandPacket->params[1] = value;
+    } else if (strcmp(name, "save") == 0 || strcmp(name, "defaults") == 0) {
+        commandPacket->command = COMMAND_SAVE_PARAMS;
+        commandPacket->params[0] = strcmp(name, "defaults") == 0;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
 void sendCommand(char command) {
     TPacket commandPacket;
 
@@ -245,10 +440,10 @@ void sendCommand(char command) {
             // sendPacket(&commandPacket);
             break;
 
+        // Emergency stop, ahead of anything still queued
         case 'e':
         case 'E':
-            commandPacket.command = COMMAND_STOP;
-            sendPacket(&commandPacket);
+            robot.postEmergencyStop();
             break;
 
         case 'c':
@@ -264,6 +459,67 @@ void sendCommand(char command) {
             sendPacket(&commandPacket);
             break;
 
+        case 'f':
+        case 'F':
+            commandPacket.command = COMMAND_GET_FIELDS;
+            getFieldsParams(&commandPacket);
+            sendPacket(&commandPacket);
+            break;
+
+        case 't':
+        case 'T':
+            commandPacket.command = COMMAND_SUBSCRIBE;
+            getTelemetryParams(&commandPacket);
+            sendPacket(&commandPacket);
+            break;
+
+        case 'u':
+        case 'U':
+            commandPacket.command = COMMAND_UNSUBSCRIBE;
+            sendPacket(&commandPacket);
+            break;
+
+        case 'p':
+        case 'P':
+            commandPacket.command = COMMAND_SET_PID;
+            getPidParams(&commandPacket);
+            sendPacket(&commandPacket);
+            break;
+
+        case 'l':
+        case 'L':
+            commandPacket.command = COMMAND_GET_POSE;
+            commandPacket.params[0] = command == 'L';
+            sendPacket(&commandPacket);
+            break;
+
+        case 'k':
+            commandPacket.command = COMMAND_GET_PARAMS;
+            sendPacket(&commandPacket);
+            break;
+
+        case 'K':
+            if (getParamCommand(&commandPacket)) {
+                sendPacket(&commandPacket);
+            } else {
+                printf("Bad parameter\n");
+            }
+            break;
+
+        case 'j':
+        case 'J':
+            commandPacket.command = COMMAND_GET_TASKS;
+            sendPacket(&commandPacket);
+            break;
+
+        // Needs firmware built with "make PROFILE=1"
+        case 'o':
+        case 'O':
+            commandPacket.command = COMMAND_GET_PROFILE;
+            commandPacket.params[0] = command == 'O';
+            sendPacket(&commandPacket);
+            break;
+
         case 'q':
         case 'Q':
             exitFlag = 1;
@@ -274,31 +530,35 @@ void sendCommand(char command) {
     }
 }
 
-int main() {
-    // Connect to the Arduino
-    startSerial(PORT_NAME, BAUD_RATE, 8, 'N', 1, 5);
+int main(int argc, char* argv[]) {
+    // Print to the console, and to the file given on the command line if any
+    startLog(formatRecord, 1, argc > 1 ? argv[1] : NULL);
+
+    // Replies to our fire-and-forget commands all end up here
+    robot.onPacket(logReceived);
+    robot.onError(logReceiveError);
+
+    // Connect to the Arduino and spawn the receiver thread
+    robot.connect(PORT_NAME, BAUD_RATE);
 
     // Sleep for two seconds
     printf("WAITING TWO SECONDS FOR ARDUINO TO REBOOT\n");
     sleep(2);
     printf("DONE\n");
 
-    // Spawn receiver thread
-    pthread_t recv;
-
-    pthread_create(&recv, NULL, receiveThread, NULL);
-
-    // Send a hello packet
-    TPacket helloPacket;
-
-    helloPacket.packetType = PACKET_TYPE_HELLO;
-    sendPacket(&helloPacket);
+    // Say hello again, the one connect() sent went to the bootloader
+    robot.hello();
 
     while (!exitFlag) {
         char ch;
         printf(
             "Command (w=forward, s=reverse, a=turn left, d=turn right, e=stop, "
-            "c=clear stats, g=get stats q=exit, USE CAPITAL LETTERS FOR MORE "
+            "c=clear stats, g=get stats, f=get some fields, t=subscribe "
+            "telemetry, u=unsubscribe, "
+            "p=set PID gains, l=pose (L also resets it), k=parameters (K "
+            "sets one), j=task timing, o=profile (O also clears it), q=exit, "
+            "USE "
+            "CAPITAL LETTERS FOR MORE "
             "POWER!!!!)\n");
         scanf("%c", &ch);
 
@@ -309,5 +569,6 @@ int main() {
     }
 
     printf("Closing connection to Arduino.\n");
-    endSerial();
+    robot.disconnect();
+    stopLog();
 }
@@ -0,0 +1,205 @@
+#include "logger.h"
+#include <semaphore.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <thread>
+
+#define LOG_QUEUE_MASK (LOG_QUEUE_LEN - 1)
+
+// How long the logger thread sleeps before flushing without new records
+#define LOG_IDLE_NS 100000000
+
+static_assert((LOG_QUEUE_LEN & LOG_QUEUE_MASK) == 0,
+              "LOG_QUEUE_LEN must be a power of two");
+
+// Bounded multi-producer, single-consumer queue. Each cell's sequence
+// number says whose turn it is: pos when free for the producer claiming
+// position pos, pos + 1 once that record is ready for the consumer.
+typedef struct {
+    std::atomic<size_t> seq;
+    TLogRecord record;
+} TLogCell;
+
+static TLogCell _cells[LOG_QUEUE_LEN];
+static std::atomic<size_t> _enqueuePos;
+static size_t _dequeuePos;
+static std::atomic<unsigned long> _dropped;
+
+static sem_t _logSema;
+static std::atomic<bool> _running;
+static std::thread _logger;
+static TLogFormatter _formatter;
+static int _toConsole;
+static FILE* _file;
+static uint64_t _start;
+
+static uint64_t nowNs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Claim a cell, fill it in and publish it. Returns 0 if the queue is full.
+static int pushRecord(const TLogRecord* record) {
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    TLogCell* cell;
+
+    while (1) {
+        cell = &_cells[pos & LOG_QUEUE_MASK];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        } else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->record = *record;
+    cell->record.timestamp = nowNs() - _start;
+    cell->seq.store(pos + 1, std::memory_order_release);
+
+    sem_post(&_logSema);
+    return 1;
+}
+
+// Only ever called from the logger thread
+static int popRecord(TLogRecord* record) {
+    TLogCell* cell = &_cells[_dequeuePos & LOG_QUEUE_MASK];
+
+    if (cell->seq.load(std::memory_order_acquire) != _dequeuePos + 1) {
+        return 0;
+    }
+
+    *record = cell->record;
+    cell->seq.store(_dequeuePos + LOG_QUEUE_LEN, std::memory_order_release);
+    _dequeuePos++;
+    return 1;
+}
+
+static void writeRecord(const TLogRecord* record) {
+    if (_toConsole) {
+        _formatter(record, stdout);
+    }
+
+    if (_file != NULL) {
+        fprintf(_file, "[%llu.%06llu] ",
+                (unsigned long long)(record->timestamp / 1000000000ULL),
+                (unsigned long long)(record->timestamp / 1000ULL % 1000000ULL));
+        _formatter(record, _file);
+    }
+}
+
+static void logThread() {
+    TLogRecord record;
+    unsigned long reported = 0;
+
+    while (1) {
+        int stopping = !_running.load();
+
+        while (popRecord(&record)) {
+            writeRecord(&record);
+        }
+
+        unsigned long dropped = _dropped.load(std::memory_order_relaxed);
+        FILE* out = _toConsole ? stdout : _file;
+        if (dropped != reported && out != NULL) {
+            fprintf(out, "LOG: %lu records dropped, logger overloaded\n",
+                    dropped - reported);
+            reported = dropped;
+        }
+
+        if (_toConsole) {
+            fflush(stdout);
+        }
+        if (_file != NULL) {
+            fflush(_file);
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_IDLE_NS;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        sem_timedwait(&_logSema, &deadline);
+    }
+}
+
+void startLog(TLogFormatter formatter, int toConsole, const char* fileName) {
+    for (size_t i = 0; i < LOG_QUEUE_LEN; i++) {
+        _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+    _enqueuePos = 0;
+    _dequeuePos = 0;
+    _dropped = 0;
+
+    _formatter = formatter;
+    _toConsole = toConsole;
+    _file = NULL;
+    if (fileName != NULL) {
+        _file = fopen(fileName, "a");
+        if (_file == NULL) {
+            perror("Unable to open log file, logging to console only");
+            _toConsole = 1;
+        }
+    }
+    _start = nowNs();
+
+    sem_init(&_logSema, 0, 0);
+    _running = true;
+    _logger = std::thread(logThread);
+}
+
+void stopLog() {
+    if (!_running.exchange(false)) {
+        return;
+    }
+
+    sem_post(&_logSema);
+    _logger.join();
+    sem_destroy(&_logSema);
+
+    if (_file != NULL) {
+        fclose(_file);
+        _file = NULL;
+    }
+}
+
+int logPacket(const TPacket* packet) {
+    TLogRecord record;
+
+    record.kind = LOG_PACKET;
+    record.error = PACKET_OK;
+    record.packet = *packet;
+
+    return pushRecord(&record);
+}
+
+int logRecvError(TResult error) {
+    TLogRecord record;
+
+    memset(&record.packet, 0, sizeof(record.packet));
+    record.kind = LOG_RECV_ERROR;
+    record.error = error;
+
+    return pushRecord(&record);
+}
+
+unsigned long logDropped() {
+    return _dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,49 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+/*
+ *  Asynchronous logger. The receive thread only copies fixed-size binary
+ *  records into a lock-free queue; a background thread formats them to the
+ *  console and/or a log file. A slow terminal therefore never holds up
+ *  packet processing. When the queue is full records are dropped and
+ *  counted instead of blocking the producer.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "../common/packet.h"
+#include "../common/serialize.h"
+
+// Records the queue can hold, must be a power of two
+#define LOG_QUEUE_LEN 256
+
+typedef enum {
+    LOG_PACKET = 0,     // A packet received from Alex
+    LOG_RECV_ERROR = 1  // A frame that failed to deserialize
+} TLogKind;
+
+typedef struct {
+    uint64_t timestamp;  // ns since startLog()
+    uint8_t kind;        // TLogKind
+    uint8_t error;       // TResult, for LOG_RECV_ERROR
+    TPacket packet;      // For LOG_PACKET
+} TLogRecord;
+
+// Turns one record into text. Runs on the logger thread, once per output.
+typedef void (*TLogFormatter)(const TLogRecord* record, FILE* out);
+
+// Start the logger thread. Records go to stdout if "toConsole" is set and
+// are appended to "fileName", prefixed by their timestamp, if not NULL.
+void startLog(TLogFormatter formatter, int toConsole, const char* fileName);
+
+// Drain what is queued and stop the logger thread
+void stopLog();
+
+// Queue a record. Never blocks; returns 0 if the record had to be dropped.
+int logPacket(const TPacket* packet);
+int logRecvError(TResult error);
+
+// Number of records dropped so far because the queue was full
+unsigned long logDropped();
+
+#endif /* LOGGER_H_ */
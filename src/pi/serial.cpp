@@ -1,6 +1,7 @@
 #include "serial.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -111,11 +112,24 @@ _serOptions.c_lflag |= ICANON; */
     tcsetattr(_fd, TCSANOW, &_serOptions);
 }
 
-int serialRead(char* buffer) {
+int serialPoll(int timeoutMs) {
+    if (_fd < 0) {
+        return -1;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = _fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, timeoutMs);
+}
+
+int serialRead(char* buffer, int len) {
     ssize_t n = 0;
 
     if (_fd >= 0) {
-        n = read(_fd, buffer, MAX_BUFFER_LEN);
+        n = read(_fd, buffer, len);
     }
 
     return n;
@@ -128,6 +142,12 @@ void serialWrite(char* buffer, int len) {
     }
 }
 
+void serialFlushOutput() {
+    if (_fd >= 0) {
+        tcflush(_fd, TCOFLUSH);
+    }
+}
+
 void endSerial() {
     if (_fd > 0) {
         close(_fd);
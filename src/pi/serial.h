@@ -5,9 +5,16 @@
 #include <termios.h>
 void startSerial(const char *portName, int baudRate, int byteSize, char parity, int stopBits, int maxAttempts);
 
-int serialRead(char *buffer);
+// Wait up to "timeoutMs" for data to read. Returns > 0 if serialRead will not block.
+int serialPoll(int timeoutMs);
+
+// Read at most "len" bytes, e.g. MAX_BUFFER_LEN into a buffer that size
+int serialRead(char *buffer, int len);
 void serialWrite(char *buffer, int len);
 
+// Discard whatever has been written but not yet sent
+void serialFlushOutput();
+
 void endSerial();
 #endif
 
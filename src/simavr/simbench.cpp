@@ -0,0 +1,795 @@
+/*
+ *  Cycle-accurate firmware benchmark on simavr.
+ *
+ *  Runs the firmware ELF on a simulated ATmega328P at 16 MHz and reports:
+ *   - cycles spent in each interrupt vector (min/avg/max, entry to reti),
+ *   - the worst interrupt latency (flag raised to vector entered),
+ *   - the worst emergency stop latency, from the receive interrupt for a
+ *     stop token's last byte being raised to the end of the ISR that cut
+ *     the PWM,
+ *   - for each ELF given, built for a different link rate, the command
+ *     throughput sustained without losing a frame, i.e. before recvbuf
+ *     overflows or the replies fall behind.
+ *
+ *  The first ELF also runs a scenario script that injects UART frames,
+ *  encoder edges and ultrasonic echoes, see scenario.txt.
+ *
+ *  With --baseline, exits 1 if any ISR's max cycles or the worst latency
+ *  grew, or any throughput dropped, by more than --tolerance percent.
+ *  --save writes this run's results in the same format.
+ *
+ *  Usage: simbench [--scenario FILE] [--baseline FILE] [--save FILE]
+ *                  [--tolerance PCT] BAUD:ELF...
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <avr_ioport.h>
+#include <avr_uart.h>
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_interrupts.h>
+#include <sim_irq.h>
+#include <sim_cycle_timers.h>
+
+#include "constants.h"
+#include "packet.h"
+#include "serialize.h"
+
+#define BENCH_MCU "atmega328p"
+#define BENCH_F_CPU 16000000UL
+
+// Let the firmware get through setup() before talking to it
+#define BENCH_BOOT_US 50000
+
+// Frames per throughput trial, and how long past the last one to wait for
+// its reply
+#define BENCH_FLOOD_FRAMES 40
+#define BENCH_DRAIN_FRAMES 4
+
+// Echo starts this long after the trigger pulse ends, as on the HC-SR04
+#define BENCH_ECHO_DELAY_US 460
+
+// ATmega328P interrupt vectors, by number
+static const char* const VECTORS[] = {
+    "RESET",       "INT0",         "INT1",        "PCINT0",
+    "PCINT1",      "PCINT2",       "WDT",         "TIMER2_COMPA",
+    "TIMER2_COMPB", "TIMER2_OVF",  "TIMER1_CAPT", "TIMER1_COMPA",
+    "TIMER1_COMPB", "TIMER1_OVF",  "TIMER0_COMPA", "TIMER0_COMPB",
+    "TIMER0_OVF",  "SPI_STC",      "USART_RX",    "USART_UDRE",
+    "USART_TX",    "ADC",          "EE_READY",    "ANALOG_COMP",
+    "TWI",         "SPM_READY"};
+#define VECTOR_COUNT (sizeof(VECTORS) / sizeof(VECTORS[0]))
+#define VECTOR_USART_RX 18
+
+typedef struct {
+    uint32_t count;
+    uint64_t total;
+    uint32_t min;
+    uint32_t max;
+    uint64_t enteredAt;
+    uint64_t pendingAt;  // 0 when not pending
+    uint64_t raisedAt;   // pendingAt of the run in progress
+} TVectorStats;
+
+typedef struct {
+    uint64_t at;  // In cycles
+    uint8_t data;
+    uint8_t stopEnd;  // Last byte of a stop token
+} TTxByte;
+
+// One simulated board. simavr calls back with a void* param, which is
+// always the one TBench in use.
+typedef struct {
+    avr_t* avr;
+    uint64_t cyclesPerByte;
+
+    TVectorStats vectors[VECTOR_COUNT];
+    uint32_t worstLatency;
+    uint8_t worstLatencyVector;
+
+    // The next USART_RX run finishes a stop token
+    int stopArmed;
+    uint32_t worstStop;
+
+    // Bytes for the firmware's UART, in time order
+    std::vector<TTxByte> toSend;
+    size_t sendNext;
+
+    // Frames coming back
+    TFrameParser parser;
+    uint32_t replies;
+    uint32_t errors;
+    uint32_t strays;  // Answers to a seq nothing was sent with
+    uint8_t seqSent[256];
+    int verbose;
+
+    // Stimulus
+    uint32_t encoderHz[2];
+    uint8_t encoderLevel[2];
+    int rangeCm;
+    uint64_t echoRiseAt;
+    uint64_t echoFallAt;
+} TBench;
+
+typedef struct {
+    int baud;
+    const char* elf;
+} TTarget;
+
+static TBench bench;
+
+static uint64_t usToCycles(uint64_t us) {
+    return us * (BENCH_F_CPU / 1000000);
+}
+
+// Interrupt bookkeeping
+
+static void onPending(avr_irq_t* irq, uint32_t value, void* param) {
+    (void)irq;
+    TVectorStats* stats = (TVectorStats*)param;
+
+    if (value && stats->pendingAt == 0) {
+        stats->pendingAt = bench.avr->cycle;
+    }
+}
+
+static void onRunning(avr_irq_t* irq, uint32_t value, void* param) {
+    (void)irq;
+    TVectorStats* stats = (TVectorStats*)param;
+    uint64_t now = bench.avr->cycle;
+
+    if (value) {
+        stats->enteredAt = now;
+        stats->raisedAt = stats->pendingAt ? stats->pendingAt : now;
+
+        if (stats->pendingAt) {
+            uint32_t latency = now - stats->pendingAt;
+            if (latency > bench.worstLatency) {
+                bench.worstLatency = latency;
+                bench.worstLatencyVector = stats - bench.vectors;
+            }
+            stats->pendingAt = 0;
+        }
+        return;
+    }
+
+    uint32_t cycles = now - stats->enteredAt;
+    stats->count++;
+    stats->total += cycles;
+    if (stats->count == 1 || cycles < stats->min) {
+        stats->min = cycles;
+    }
+    if (cycles > stats->max) {
+        stats->max = cycles;
+    }
+
+    if (bench.stopArmed && stats == &bench.vectors[VECTOR_USART_RX]) {
+        bench.stopArmed = 0;
+        if (now - stats->raisedAt > bench.worstStop) {
+            bench.worstStop = now - stats->raisedAt;
+        }
+    }
+}
+
+// UART
+
+static void onUartOutput(avr_irq_t* irq, uint32_t value, void* param) {
+    (void)irq;
+    (void)param;
+    char byte = value;
+    int used;
+
+    TResult result = parseFrame(&bench.parser, &byte, 1, &used);
+    if (result == PACKET_INCOMPLETE) {
+        return;
+    }
+
+    if (result != PACKET_OK) {
+        bench.errors++;
+        return;
+    }
+
+    const TPacket* reply = (const TPacket*)framePayload(&bench.parser);
+    if (reply->seq != 0 && !bench.seqSent[(uint8_t)reply->seq]) {
+        bench.strays++;
+    }
+
+    if (reply->packetType == PACKET_TYPE_ERROR) {
+        bench.errors++;
+    } else {
+        bench.replies++;
+    }
+
+    if (bench.verbose) {
+        printf("  %8.3f ms  reply type %d command %d seq %d\n",
+               bench.avr->cycle * 1000.0 / BENCH_F_CPU, reply->packetType,
+               reply->command, reply->seq);
+    }
+}
+
+static avr_cycle_count_t sendByte(avr_t* avr,
+                                  avr_cycle_count_t when,
+                                  void* param) {
+    (void)when;
+    (void)param;
+
+    if (bench.sendNext == bench.toSend.size()) {
+        return 0;
+    }
+
+    avr_irq_t* input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'),
+                                     UART_IRQ_INPUT);
+    const TTxByte* byte = &bench.toSend[bench.sendNext++];
+    bench.stopArmed |= byte->stopEnd;
+    avr_raise_irq(input, byte->data);
+
+    if (bench.sendNext == bench.toSend.size()) {
+        return 0;
+    }
+    return bench.toSend[bench.sendNext].at;
+}
+
+// Queue "len" bytes to go out back to back from "at" on, after anything
+// already queued
+static void queueBytes(uint64_t at, const char* data, int len) {
+    bool idle = bench.sendNext == bench.toSend.size();
+
+    if (!bench.toSend.empty() &&
+        bench.toSend.back().at + bench.cyclesPerByte > at) {
+        at = bench.toSend.back().at + bench.cyclesPerByte;
+    }
+
+    for (int i = 0; i < len; i++) {
+        bench.toSend.push_back({at, (uint8_t)data[i], 0});
+        at += bench.cyclesPerByte;
+    }
+
+    if (idle) {
+        uint64_t first = bench.toSend[bench.sendNext].at;
+        uint64_t now = bench.avr->cycle;
+        avr_cycle_timer_register(bench.avr, first > now ? first - now : 1,
+                                 sendByte, NULL);
+    }
+}
+
+static void queueCommand(uint64_t at,
+                         uint8_t type,
+                         const uint32_t* params,
+                         int paramCount,
+                         uint8_t seq) {
+    TPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.packetType = PACKET_TYPE_COMMAND;
+    packet.command = type;
+    packet.seq = seq;
+    for (int i = 0; i < paramCount; i++) {
+        packet.params[i] = params[i];
+    }
+
+    char frame[MAX_FRAME_SIZE];
+    int len = serialize(frame, &packet, sizeof(packet));
+    queueBytes(at, frame, len);
+    bench.seqSent[seq] = 1;
+}
+
+static void queueStop(uint64_t at, uint8_t seq) {
+    char token[STOP_TOKEN_SIZE];
+    int len = serializeStop(token, seq);
+    queueBytes(at, token, len);
+    bench.toSend.back().stopEnd = 1;
+    bench.seqSent[seq] = 1;
+}
+
+// Encoders, on PD2 (INT0) and PD3 (INT1)
+
+static avr_cycle_count_t toggleEncoder(avr_t* avr,
+                                       avr_cycle_count_t when,
+                                       void* param) {
+    int wheel = (intptr_t)param;
+    uint32_t hz = bench.encoderHz[wheel];
+
+    if (hz == 0) {
+        return 0;
+    }
+
+    bench.encoderLevel[wheel] ^= 1;
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2 + wheel),
+                  bench.encoderLevel[wheel]);
+
+    return when + BENCH_F_CPU / hz / 2;
+}
+
+static void setEncoders(uint32_t leftHz, uint32_t rightHz) {
+    uint32_t hz[2] = {leftHz, rightHz};
+
+    for (int wheel = 0; wheel < 2; wheel++) {
+        bool running = bench.encoderHz[wheel] != 0;
+        bench.encoderHz[wheel] = hz[wheel];
+
+        if (hz[wheel] && !running) {
+            avr_cycle_timer_register(bench.avr, BENCH_F_CPU / hz[wheel] / 2,
+                                     toggleEncoder, (void*)(intptr_t)wheel);
+        }
+    }
+}
+
+// Ultrasonic: answer each trigger (PB3) with an echo pulse on PB4
+
+static avr_cycle_count_t echoEdge(avr_t* avr,
+                                  avr_cycle_count_t when,
+                                  void* param) {
+    (void)param;
+    avr_irq_t* echo = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 4);
+
+    if (when >= bench.echoFallAt) {
+        avr_raise_irq(echo, 0);
+        return 0;
+    }
+
+    avr_raise_irq(echo, 1);
+    return bench.echoFallAt;
+}
+
+static void onTrigger(avr_irq_t* irq, uint32_t value, void* param) {
+    (void)irq;
+    (void)param;
+
+    // The ping goes out on the falling edge of the trigger pulse
+    if (value || bench.rangeCm <= 0) {
+        return;
+    }
+
+    uint64_t now = bench.avr->cycle;
+    bench.echoRiseAt = now + usToCycles(BENCH_ECHO_DELAY_US);
+    bench.echoFallAt = bench.echoRiseAt + usToCycles(bench.rangeCm * 58);
+    avr_cycle_timer_register(bench.avr, bench.echoRiseAt - now, echoEdge,
+                             NULL);
+}
+
+// Board set-up and running
+
+static void startBoard(const TTarget* target, int verbose) {
+    bench.toSend.clear();
+    bench.sendNext = 0;
+    memset(&bench.parser, 0, sizeof(bench.parser));
+    memset(bench.vectors, 0, sizeof(bench.vectors));
+    bench.worstLatency = 0;
+    bench.worstLatencyVector = 0;
+    bench.stopArmed = 0;
+    bench.worstStop = 0;
+    bench.replies = 0;
+    bench.errors = 0;
+    bench.strays = 0;
+    memset(bench.seqSent, 0, sizeof(bench.seqSent));
+    bench.verbose = verbose;
+    bench.encoderHz[0] = bench.encoderHz[1] = 0;
+    bench.encoderLevel[0] = bench.encoderLevel[1] = 1;
+    bench.rangeCm = 0;
+
+    elf_firmware_t firmware;
+    memset(&firmware, 0, sizeof(firmware));
+    if (elf_read_firmware(target->elf, &firmware) != 0) {
+        fprintf(stderr, "simbench: cannot read %s\n", target->elf);
+        exit(2);
+    }
+    strcpy(firmware.mmcu, BENCH_MCU);
+    firmware.frequency = BENCH_F_CPU;
+
+    bench.avr = avr_make_mcu_by_name(BENCH_MCU);
+    if (!bench.avr) {
+        fprintf(stderr, "simbench: simavr has no %s\n", BENCH_MCU);
+        exit(2);
+    }
+    avr_init(bench.avr);
+    avr_load_firmware(bench.avr, &firmware);
+    bench.avr->frequency = BENCH_F_CPU;
+
+    // 8N1: 10 bits a byte
+    bench.cyclesPerByte = BENCH_F_CPU * 10 / target->baud;
+
+    // Keep the firmware's output off our stdout
+    uint32_t flags = 0;
+    avr_ioctl(bench.avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(bench.avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+    avr_irq_register_notify(
+        avr_io_getirq(bench.avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT),
+        onUartOutput, NULL);
+    avr_irq_register_notify(
+        avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 3), onTrigger,
+        NULL);
+
+    for (size_t v = 1; v < VECTOR_COUNT; v++) {
+        avr_irq_t* irq = avr_get_interrupt_irq(bench.avr, v);
+        if (irq) {
+            avr_irq_register_notify(irq + AVR_INT_IRQ_PENDING, onPending,
+                                    &bench.vectors[v]);
+            avr_irq_register_notify(irq + AVR_INT_IRQ_RUNNING, onRunning,
+                                    &bench.vectors[v]);
+        }
+    }
+
+    // Encoders idle high, behind their pull-ups
+    avr_raise_irq(avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2), 1);
+    avr_raise_irq(avr_io_getirq(bench.avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 3), 1);
+}
+
+// Run until cycle "until". Returns 0 if the firmware crashed or stopped.
+static int runUntil(uint64_t until) {
+    while (bench.avr->cycle < until) {
+        int state = avr_run(bench.avr);
+        if (state == cpu_Done || state == cpu_Crashed) {
+            fprintf(stderr, "simbench: firmware stopped at cycle %llu\n",
+                    (unsigned long long)bench.avr->cycle);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void stopBoard() {
+    avr_terminate(bench.avr);
+    bench.avr = NULL;
+}
+
+// Scenario scripts
+
+typedef struct {
+    const char* name;
+    TCommandType type;
+} TCommandName;
+
+static const TCommandName COMMANDS[] = {
+    {"forward", COMMAND_FORWARD},     {"reverse", COMMAND_REVERSE},
+    {"left", COMMAND_TURN_LEFT},      {"right", COMMAND_TURN_RIGHT},
+    {"stop", COMMAND_STOP},           {"stats", COMMAND_GET_STATS},
+    {"clear", COMMAND_CLEAR_STATS},   {"subscribe", COMMAND_SUBSCRIBE},
+    {"unsubscribe", COMMAND_UNSUBSCRIBE}, {"pid", COMMAND_SET_PID},
+    {"pose", COMMAND_GET_POSE},       {"params", COMMAND_GET_PARAMS},
+    {"setparam", COMMAND_SET_PARAM},  {"saveparams", COMMAND_SAVE_PARAMS},
+    {"fields", COMMAND_GET_FIELDS},   {"tasks", COMMAND_GET_TASKS},
+};
+
+static int commandType(const char* name) {
+    for (const TCommandName& command : COMMANDS) {
+        if (strcmp(command.name, name) == 0) {
+            return command.type;
+        }
+    }
+
+    return isdigit((unsigned char)name[0]) ? atoi(name) : -1;
+}
+
+// Lines are "<ms> <event> <args...>", in time order:
+//   command NAME|NUMBER [PARAM...]   send a command frame
+//   bytes HEX...                     send raw bytes
+//   estop                            send an emergency stop token
+//   encoders LEFT_HZ RIGHT_HZ        falling edges a second, 0 stops
+//   range CM                         obstacle distance, 0 for no echo
+//   end                              stop the scenario
+static int runScenario(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+
+    char line[256];
+    int lineNo = 0;
+    uint8_t seq = 1;
+    uint64_t endAt = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNo++;
+
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = 0;
+        }
+
+        char* words[20];
+        int count = 0;
+        for (char* word = strtok(line, " \t\r\n"); word && count < 20;
+             word = strtok(NULL, " \t\r\n")) {
+            words[count++] = word;
+        }
+        if (count == 0) {
+            continue;
+        }
+        if (count < 2) {
+            fprintf(stderr, "%s:%d: expected \"<ms> <event>\"\n", path, lineNo);
+            return 0;
+        }
+
+        uint64_t at = usToCycles(strtoull(words[0], NULL, 10) * 1000);
+        if (!runUntil(at)) {
+            return 0;
+        }
+
+        const char* event = words[1];
+        if (strcmp(event, "command") == 0 && count >= 3) {
+            int type = commandType(words[2]);
+            if (type < 0) {
+                fprintf(stderr, "%s:%d: unknown command %s\n", path, lineNo,
+                        words[2]);
+                return 0;
+            }
+
+            uint32_t params[16];
+            int paramCount = 0;
+            for (int i = 3; i < count && paramCount < 16; i++) {
+                params[paramCount++] = strtoul(words[i], NULL, 0);
+            }
+            queueCommand(at, type, params, paramCount, seq++);
+        } else if (strcmp(event, "estop") == 0) {
+            queueStop(at, seq++);
+        } else if (strcmp(event, "bytes") == 0) {
+            char data[18];
+            int len = 0;
+            for (int i = 2; i < count; i++) {
+                data[len++] = strtoul(words[i], NULL, 16);
+            }
+            queueBytes(at, data, len);
+        } else if (strcmp(event, "encoders") == 0 && count == 4) {
+            setEncoders(atoi(words[2]), atoi(words[3]));
+        } else if (strcmp(event, "range") == 0 && count == 3) {
+            bench.rangeCm = atoi(words[2]);
+        } else if (strcmp(event, "end") == 0) {
+            endAt = at;
+            break;
+        } else {
+            fprintf(stderr, "%s:%d: bad event \"%s\"\n", path, lineNo, event);
+            return 0;
+        }
+    }
+
+    fclose(file);
+
+    if (!runUntil(endAt)) {
+        return 0;
+    }
+
+    // A stop token read out of a frame's payload is answered with the seq
+    // in it
+    if (bench.strays) {
+        fprintf(stderr, "%s: %u replies to seqs never sent\n", path,
+                bench.strays);
+        return 0;
+    }
+
+    return 1;
+}
+
+// Throughput
+
+// Send BENCH_FLOOD_FRAMES commands "gap" byte times apart, beyond the frame
+// itself. Returns 1 if every one was answered and none was garbled.
+static int floodTrial(const TTarget* target, uint32_t gap, double* bytesPerS) {
+    startBoard(target, 0);
+
+    uint64_t start = usToCycles(BENCH_BOOT_US);
+    if (!runUntil(start)) {
+        stopBoard();
+        return 0;
+    }
+
+    // Cheapest command there is: it only answers RESP_OK
+    uint64_t spacing = (PACKET_SIZE + gap) * bench.cyclesPerByte;
+    uint32_t param = 0;
+    for (int i = 0; i < BENCH_FLOOD_FRAMES; i++) {
+        queueCommand(start + i * spacing, COMMAND_CLEAR_STATS, &param, 1,
+                     1 + i % 127);
+    }
+
+    uint64_t lastByte = bench.toSend.back().at;
+    int ran = runUntil(lastByte +
+                       BENCH_DRAIN_FRAMES * PACKET_SIZE * bench.cyclesPerByte);
+
+    int ok = ran && bench.replies == BENCH_FLOOD_FRAMES && bench.errors == 0;
+    *bytesPerS = (double)BENCH_FLOOD_FRAMES * PACKET_SIZE * BENCH_F_CPU /
+                 (lastByte + bench.cyclesPerByte - start);
+
+    stopBoard();
+    return ok;
+}
+
+// Highest command byte rate with no lost frames, or 0 if even one frame
+// per ten frame times loses some
+static double sustainedRate(const TTarget* target) {
+    double rate;
+
+    if (floodTrial(target, 0, &rate)) {
+        return rate;
+    }
+
+    uint32_t good = 10 * PACKET_SIZE;
+    uint32_t bad = 0;
+    double goodRate;
+    if (!floodTrial(target, good, &goodRate)) {
+        return 0;
+    }
+
+    while (good - bad > 1) {
+        uint32_t gap = (good + bad) / 2;
+        if (floodTrial(target, gap, &rate)) {
+            good = gap;
+            goodRate = rate;
+        } else {
+            bad = gap;
+        }
+    }
+
+    return goodRate;
+}
+
+// Results, as "key value" lines so a run can be saved as the next baseline
+
+typedef std::map<std::string, double> TResults;
+
+static int loadResults(const char* path, TResults* results) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        return 0;
+    }
+
+    char key[64];
+    double value;
+    while (fscanf(file, "%63s %lf", key, &value) == 2) {
+        (*results)[key] = value;
+    }
+
+    fclose(file);
+    return 1;
+}
+
+static void saveResults(const char* path, const TResults& results) {
+    FILE* file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        exit(2);
+    }
+
+    for (const auto& result : results) {
+        fprintf(file, "%s %.0f\n", result.first.c_str(), result.second);
+    }
+
+    fclose(file);
+}
+
+// Higher is worse for cycles and latency, lower for throughput
+static int compareResults(const TResults& baseline,
+                          const TResults& results,
+                          double tolerance) {
+    int regressions = 0;
+
+    for (const auto& result : results) {
+        auto old = baseline.find(result.first);
+        if (old == baseline.end() || old->second == 0) {
+            continue;
+        }
+
+        double change = (result.second - old->second) / old->second * 100;
+        bool throughput = result.first.rfind("bytes_per_s.", 0) == 0;
+        if (throughput ? change < -tolerance : change > tolerance) {
+            printf("REGRESSION %s: %.0f -> %.0f (%+.1f%%)\n",
+                   result.first.c_str(), old->second, result.second, change);
+            regressions++;
+        }
+    }
+
+    return regressions;
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: simbench [--scenario FILE] [--baseline FILE] [--save "
+            "FILE] [--tolerance PCT] BAUD:ELF...\n");
+    exit(2);
+}
+
+int main(int argc, char* argv[]) {
+    const char* scenario = NULL;
+    const char* baseline = NULL;
+    const char* save = NULL;
+    double tolerance = 10;
+    std::vector<TTarget> targets;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            scenario = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else {
+            char* colon = strchr(argv[i], ':');
+            if (!colon || atoi(argv[i]) <= 0) {
+                usage();
+            }
+            targets.push_back({atoi(argv[i]), colon + 1});
+        }
+    }
+
+    if (targets.empty()) {
+        usage();
+    }
+
+    TResults results;
+
+    if (scenario) {
+        printf("Scenario %s on %s (%d baud)\n", scenario, targets[0].elf,
+               targets[0].baud);
+
+        startBoard(&targets[0], 1);
+        if (!runScenario(scenario)) {
+            return 2;
+        }
+
+        printf("\n%-14s %8s %8s %8s %8s  cycles\n", "Vector", "Count", "Min",
+               "Avg", "Max");
+        for (size_t v = 1; v < VECTOR_COUNT; v++) {
+            const TVectorStats* stats = &bench.vectors[v];
+            if (stats->count == 0) {
+                continue;
+            }
+
+            printf("%-14s %8u %8u %8llu %8u\n", VECTORS[v], stats->count,
+                   stats->min,
+                   (unsigned long long)(stats->total / stats->count),
+                   stats->max);
+            results[std::string("isr_max_cycles.") + VECTORS[v]] = stats->max;
+        }
+
+        printf("\nWorst interrupt latency: %u cycles (%.1f us), %s\n",
+               bench.worstLatency, bench.worstLatency * 1e6 / BENCH_F_CPU,
+               VECTORS[bench.worstLatencyVector]);
+        printf("Replies %u, errors %u\n\n", bench.replies, bench.errors);
+        results["worst_latency_cycles"] = bench.worstLatency;
+
+        if (bench.worstStop) {
+            printf("Worst emergency stop: %u cycles (%.1f us)\n\n",
+                   bench.worstStop, bench.worstStop * 1e6 / BENCH_F_CPU);
+            results["estop_cycles"] = bench.worstStop;
+        }
+
+        stopBoard();
+    }
+
+    printf("%-8s %12s %12s  sustained without loss\n", "Baud", "Line B/s",
+           "Command B/s");
+    for (const TTarget& target : targets) {
+        double rate = sustainedRate(&target);
+        printf("%-8d %12d %12.0f\n", target.baud, target.baud / 10, rate);
+        results["bytes_per_s." + std::to_string(target.baud)] = rate;
+    }
+
+    if (save) {
+        saveResults(save, results);
+    }
+
+    if (baseline) {
+        TResults old;
+        if (!loadResults(baseline, &old)) {
+            return 2;
+        }
+        if (compareResults(old, results, tolerance) > 0) {
+            return 1;
+        }
+        printf("No regressions against %s (tolerance %.0f%%)\n", baseline,
+               tolerance);
+    }
+
+    return 0;
+}